@@ -1,2 +1,2 @@
 @rmdir /S /Q lz4 2>NUL >NUL
-svn checkout http://lz4.googlecode.com/svn/trunk/ lz4
+git clone --depth 1 --branch v1.9.4 https://github.com/lz4/lz4.git lz4
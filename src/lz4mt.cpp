@@ -1,13 +1,22 @@
 #include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
+#include <climits>
 #include <future>
+#include <map>
+#include <new>
 #include <mutex>
 #include <vector>
 #include "lz4mt.h"
 #include "lz4mt_xxh32.h"
 #include "lz4mt_mempool.h"
 #include "lz4mt_compat.h"
+#include "lz4mt_threadpool.h"
+#include "lz4mt_commitring.h"
+#include "lz4mt_engine.h"
+#include "lz4mt_dictionary.h"
+#include "lz4mt_probe.h"
 
 #include "lz4.h"
 #include "lz4hc.h"
@@ -19,17 +28,20 @@ namespace {
 const uint32_t LZ4S_MAGICNUMBER = 0x184D2204;
 const uint32_t LZ4S_MAGICNUMBER_SKIPPABLE_MIN = 0x184D2A50;
 const uint32_t LZ4S_MAGICNUMBER_SKIPPABLE_MAX = 0x184D2A5F;
+const uint32_t LZ4S_LEGACY_MAGICNUMBER = 0x184C2102;
+const int LZ4S_LEGACY_BLOCKSIZE = 8 * 1024 * 1024;
 const uint32_t LZ4S_BLOCKSIZEID_DEFAULT = 7;
 const uint32_t LZ4S_CHECKSUM_SEED = 0;
 const uint32_t LZ4S_EOS = 0;
 const uint32_t LZ4S_MAX_HEADER_SIZE = 4 + 2 + 8 + 4 + 1;
-const uint32_t LZ4S_MIN_STREAM_BUFSIZE = (1024 + 64) * 1024;
 const uint32_t LZ4S_CACHELINE = 64;
 
 const uint32_t LZ4MT_SRC_BITS_INCOMPRESSIBLE_MASK = 1U << 31;
 const uint32_t LZ4MT_SRC_BITS_SIZE_MASK = ~LZ4MT_SRC_BITS_INCOMPRESSIBLE_MASK;
 
-typedef std::unique_ptr<Lz4Mt::MemPool::Buffer> BufferPtr;
+typedef Lz4Mt::MemPool::BufferPtr BufferPtr;
+typedef Lz4Mt::MemPool::SharedBufferPtr SharedBufferPtr;
+typedef std::chrono::steady_clock Clock;
 
 int getBlockSize(int bdBlockMaximumSize) {
 	assert(bdBlockMaximumSize >= 4 && bdBlockMaximumSize <= 7);
@@ -44,6 +56,10 @@ bool isMagicNumber(uint32_t magic) {
 	return LZ4S_MAGICNUMBER == magic;
 }
 
+bool isLegacyMagicNumber(uint32_t magic) {
+	return LZ4S_LEGACY_MAGICNUMBER == magic;
+}
+
 bool isSkippableMagicNumber(uint32_t magic) {
 	return magic >= LZ4S_MAGICNUMBER_SKIPPABLE_MIN
 		&& magic <= LZ4S_MAGICNUMBER_SKIPPABLE_MAX;
@@ -141,10 +157,6 @@ validateStreamDescriptor(const Lz4MtStreamDescriptor* sd) {
 	if(1 != sd->flg.versionNumber) {
 		return LZ4MT_RESULT_INVALID_VERSION;
 	}
-	if(0 != sd->flg.presetDictionary) {
-		///	@TODO: Implement Preset Dictionary.
-		return LZ4MT_RESULT_PRESET_DICTIONARY_IS_NOT_SUPPORTED_YET;
-	}
 	if(0 != sd->flg.reserved1) {
 		return LZ4MT_RESULT_INVALID_HEADER_RESERVED1;
 	}
@@ -160,14 +172,135 @@ validateStreamDescriptor(const Lz4MtStreamDescriptor* sd) {
 	return LZ4MT_RESULT_OK;
 }
 
+// Lz4MtContext::allocate / deallocate.
+class HookAllocator : public Lz4Mt::Allocator {
+public:
+	explicit HookAllocator(const Lz4MtContext* lz4MtContext)
+		: lz4MtContext(lz4MtContext)
+	{}
+
+	static bool isEnabled(const Lz4MtContext* lz4MtContext) {
+		return lz4MtContext->allocate && lz4MtContext->deallocate;
+	}
+
+	void* allocate(size_t size) {
+		return lz4MtContext->allocate(lz4MtContext, size);
+	}
+
+	void deallocate(void* ptr, size_t size) {
+		lz4MtContext->deallocate(lz4MtContext, ptr, size);
+	}
+
+private:
+	HookAllocator(const HookAllocator&);
+	const HookAllocator& operator=(const HookAllocator&);
+
+	const Lz4MtContext* lz4MtContext;
+};
+
+
+class HeapAllocator : public Lz4Mt::Allocator {
+public:
+	void* allocate(size_t size) {
+		return new (std::nothrow) char[size];
+	}
+
+	void deallocate(void* ptr, size_t) {
+		delete [] static_cast<char*>(ptr);
+	}
+};
+
+
+// Uninitialized buffer from 'allocator', given back when it goes away.
+// get() is nullptr when it couldn't be allocated.
+class ScratchBuffer {
+public:
+	ScratchBuffer()
+		: allocator(nullptr), ptr(nullptr), size(0)
+	{}
+
+	ScratchBuffer(Lz4Mt::Allocator& allocator, size_t size)
+		: allocator(&allocator)
+		, ptr(static_cast<char*>(allocator.allocate(size)))
+		, size(size)
+	{}
+
+	ScratchBuffer(ScratchBuffer&& x)
+		: allocator(x.allocator), ptr(x.ptr), size(x.size)
+	{
+		x.ptr = nullptr;
+	}
+
+	~ScratchBuffer() {
+		reset();
+	}
+
+	ScratchBuffer& operator=(ScratchBuffer&& x) {
+		std::swap(allocator, x.allocator);
+		std::swap(ptr, x.ptr);
+		std::swap(size, x.size);
+		return *this;
+	}
+
+	char* get() const {
+		return ptr;
+	}
+
+	void reset() {
+		if(ptr) {
+			allocator->deallocate(ptr, size);
+			ptr = nullptr;
+		}
+	}
+
+private:
+	ScratchBuffer(const ScratchBuffer&);
+	const ScratchBuffer& operator=(const ScratchBuffer&);
+
+	Lz4Mt::Allocator* allocator;
+	char* ptr;
+	size_t size;
+};
+
+
 class Ctx {
 public:
 	Ctx(Lz4MtContext* lz4MtContext)
 		: lz4MtContext(lz4MtContext)
 		, mutResult()
 		, atmQuit(false)
+		, numaLocalBlocks(0)
+		, numaRemoteBlocks(0)
+		, historyCopyBytes(0)
+		, probedRawBlocks(0)
+		, hcFallbackBlocks(0)
+		, hcOverrunBlocks(0)
+		, levelBlocks()
+		, bufferCounters()
+		, hookAllocator(lz4MtContext)
+		, heapAllocator()
+		, unreadBuffer()
+		, unreadSize(0)
+		, unreadPos(0)
 	{}
 
+	~Ctx() {
+		if(auto* stats = lz4MtContext->stats) {
+			stats->numaLocalBlocks  += numaLocalBlocks;
+			stats->numaRemoteBlocks += numaRemoteBlocks;
+			stats->historyCopyBytes += historyCopyBytes;
+			stats->probedRawBlocks  += probedRawBlocks;
+			stats->hcFallbackBlocks += hcFallbackBlocks;
+			stats->hcOverrunBlocks  += hcOverrunBlocks;
+			for(size_t i = 0; i < levelBlocks.size(); ++i) {
+				stats->levelBlocks[i] += levelBlocks[i];
+			}
+			stats->bufferAllocs     += bufferCounters.allocs;
+			stats->bufferFrees      += bufferCounters.frees;
+			stats->bufferWaits      += bufferCounters.waits;
+		}
+	}
+
 	bool error() const {
 		Lock lock(mutResult);
 		return LZ4MT_RESULT_OK != lz4MtContext->result;
@@ -204,6 +337,15 @@ public:
 		return loadU32(d);
 	}
 
+	// Read a u32 without touching the result.  Returns the number of bytes
+	// actually read : 0 at the end of input.
+	int readU32(uint32_t& v) {
+		char d[sizeof(uint32_t)];
+		const auto n = lz4MtContext->read(lz4MtContext, d, sizeof(d));
+		v = (sizeof(d) == n) ? loadU32(d) : 0;
+		return n;
+	}
+
 	bool writeU32(uint32_t v) {
 		char d[sizeof(v)];
 		storeU32(d, v);
@@ -226,9 +368,25 @@ public:
 	}
 
 	int read(void* dst, int dstSize) {
+		if(unreadPos < unreadSize) {
+			const auto n = std::min(dstSize, unreadSize - unreadPos);
+			memcpy(dst, unreadBuffer.get() + unreadPos, n);
+			unreadPos += n;
+			if(unreadPos == unreadSize) {
+				unreadBuffer.reset();
+			}
+			return n;
+		}
 		return lz4MtContext->read(lz4MtContext, dst, dstSize);
 	}
 
+	// Give back 'size' bytes of 'buffer' : read() returns them first.
+	void unread(ScratchBuffer&& buffer, int size) {
+		unreadBuffer = std::move(buffer);
+		unreadSize = size;
+		unreadPos = 0;
+	}
+
 	int readSeek(int offset) {
 		return lz4MtContext->readSeek(lz4MtContext, offset);
 	}
@@ -245,8 +403,16 @@ public:
 		return lz4MtContext->write(lz4MtContext, src, srcSize);
 	}
 
-	int compress(const char* src, char* dst, int isize, int maxOutputSize) {
-		return lz4MtContext->compress(src, dst, isize, maxOutputSize, lz4MtContext->compressionLevel);
+	int compress(void* state, const char* src, char* dst, int isize, int maxOutputSize, int level) {
+		return lz4MtContext->compress(state, src, dst, isize, maxOutputSize, level);
+	}
+
+	size_t compressStateSize() const {
+		return lz4MtContext->compressStateSize;
+	}
+
+	int compressBound(int isize) {
+		return lz4MtContext->compressBound(isize);
 	}
 
 	int decompress(const char* src, char* dst, int isize, int maxOutputSize) {
@@ -263,75 +429,452 @@ public:
 		return atmQuit;
 	}
 
+	// Count whether the calling worker runs on the node of 'buffer'.
+	void countNumaPlacement(const void* buffer) {
+		if(nullptr == lz4MtContext->stats) {
+			return;
+		}
+		const auto bufferNode = Lz4Mt::getNumaNodeOfAddress(buffer);
+		const auto cpuNode = Lz4Mt::getCurrentNumaNode();
+		if(bufferNode < 0 || cpuNode < 0) {
+			return;
+		}
+		++(bufferNode == cpuNode ? numaLocalBlocks : numaRemoteBlocks);
+	}
+
+	void countHistoryCopy(uint64_t bytes) {
+		historyCopyBytes += bytes;
+	}
+
+	void countProbedRawBlock() {
+		++probedRawBlocks;
+	}
+
+	void countHcFallback() {
+		++hcFallbackBlocks;
+	}
+
+	void countHcOverrun() {
+		++hcOverrunBlocks;
+	}
+
+	void countLevel(int level) {
+		const auto i = std::min(std::max(level - LZ4MT_STATS_LEVEL_MIN, 0)
+							  , LZ4MT_STATS_LEVEL_COUNT - 1);
+		++levelBlocks[i];
+	}
+
+	// MemPools of this Ctx must be destroyed before the Ctx.
+	Lz4Mt::MemPool::Counters* poolCounters() {
+		return &bufferCounters;
+	}
+
+	bool hugePages() const {
+		return 0 != lz4MtContext->hugePages;
+	}
+
+	// Buffers and codec state go through Lz4MtContext's allocator hooks,
+	// if any.  poolAllocator() is nullptr without them : MemPool maps its
+	// own (huge) pages.
+	Lz4Mt::Allocator& allocator() {
+		if(HookAllocator::isEnabled(lz4MtContext)) {
+			return hookAllocator;
+		}
+		return heapAllocator;
+	}
+
+	Lz4Mt::Allocator* poolAllocator() {
+		return HookAllocator::isEnabled(lz4MtContext) ? &hookAllocator : nullptr;
+	}
+
 private:
+	Ctx(const Ctx&);
+	const Ctx& operator=(const Ctx&);
+
 	typedef std::unique_lock<std::mutex> Lock;
 	Lz4MtContext* lz4MtContext;
 	mutable std::mutex mutResult;
 	std::atomic<bool> atmQuit;
+	std::atomic<uint64_t> numaLocalBlocks;
+	std::atomic<uint64_t> numaRemoteBlocks;
+	std::atomic<uint64_t> historyCopyBytes;
+	std::atomic<uint64_t> probedRawBlocks;
+	std::atomic<uint64_t> hcFallbackBlocks;
+	std::atomic<uint64_t> hcOverrunBlocks;
+	std::array<std::atomic<uint64_t>, LZ4MT_STATS_LEVEL_COUNT> levelBlocks;
+	Lz4Mt::MemPool::Counters bufferCounters;
+	HookAllocator hookAllocator;
+	HeapAllocator heapAllocator;
+	ScratchBuffer unreadBuffer;
+	int unreadSize;
+	int unreadPos;
 };
 
 
+Lz4MtEngine* getEngine(const Lz4MtContext* lz4MtContext) {
+	if(0 != (lz4MtContext->mode & LZ4MT_MODE_SEQUENTIAL)) {
+		return nullptr;
+	}
+	return lz4MtContext->engine;
+}
+
+
+// Bytes of buffers in flight which may be used : Lz4MtContext::memoryBudget
+// and half of the cgroup memory limit.  0 : unlimited.
+uint64_t getMemoryBudget(const Lz4MtContext* lz4MtContext) {
+	uint64_t budget = lz4MtContext->memoryBudget;
+	if(const auto limit = Lz4Mt::getMemoryLimit() / 2) {
+		if(0 == budget || limit < budget) {
+			budget = limit;
+		}
+	}
+	return budget;
+}
+
+
+// Blocks which fit into the memory budget.  Each of them holds a src and
+// a dst buffer.  At least one block always fits.  0 : unlimited.
+unsigned getBudgetBlocks(const Lz4MtContext* lz4MtContext, int blockSize) {
+	const auto budget = getMemoryBudget(lz4MtContext);
+	if(0 == budget) {
+		return 0;
+	}
+	const auto blockBytes = 2 * static_cast<uint64_t>(blockSize);
+	return static_cast<unsigned>(std::max<uint64_t>(
+		std::min<uint64_t>(budget / blockBytes, UINT_MAX), 1));
+}
+
+
+// NOTE : Each worker keeps about two blocks in flight, so a tight memory
+//        budget gets fewer private workers.  The workers of a shared engine
+//        are left alone; its own budget applies to them.
+unsigned getThreadCount(const Lz4MtContext* lz4MtContext, int blockSize) {
+	if(0 != (lz4MtContext->mode & LZ4MT_MODE_SEQUENTIAL)) {
+		return 0;
+	}
+	if(auto* engine = getEngine(lz4MtContext)) {
+		return engine->threadPool.size();
+	}
+	auto n = lz4MtContext->nThread > 0
+		? static_cast<unsigned>(lz4MtContext->nThread)
+		: Lz4Mt::getHardwareConcurrency();
+	if(const auto m = getBudgetBlocks(lz4MtContext, blockSize)) {
+		n = std::min(n, std::max((m + 1) / 2, 1u));
+	}
+	return n;
+}
+
+
+std::vector<unsigned> getCpuList(const Lz4MtContext* lz4MtContext) {
+	std::vector<unsigned> cpus;
+	if(lz4MtContext->cpuList) {
+		Lz4Mt::parseCpuList(lz4MtContext->cpuList, cpus);
+	}
+	return cpus;
+}
+
+
+bool isValidCpuList(const Lz4MtContext* lz4MtContext) {
+	std::vector<unsigned> cpus;
+	return nullptr == lz4MtContext->cpuList
+		|| Lz4Mt::parseCpuList(lz4MtContext->cpuList, cpus);
+}
+
+
+// Maximum number of blocks in flight, capped to the memory budget.
+unsigned getWindowSize(const Lz4MtContext* lz4MtContext, unsigned nThread, int blockSize) {
+	if(0 != (lz4MtContext->mode & LZ4MT_MODE_SEQUENTIAL)) {
+		return 1;
+	}
+	auto n = nThread * 2;
+	if(const auto m = getBudgetBlocks(lz4MtContext, blockSize)) {
+		n = std::min(n, m);
+	}
+	return n;
+}
+
+
+const Lz4MtDictionary* getDictionary(
+	  const Lz4MtContext* lz4MtContext
+	, const Lz4MtStreamDescriptor* sd
+) {
+	if(sd->flg.presetDictionary && lz4MtContext->lookupDictionary) {
+		if(const auto* d = lz4MtContext->lookupDictionary(lz4MtContext, sd->dictId)) {
+			return d;
+		}
+	}
+	return lz4MtContext->dictionary;
+}
+
+
+int getMinLevel(const Lz4MtContext* lz4MtContext) {
+	const auto level = lz4MtContext->compressionLevel;
+	if(lz4MtContext->adaptiveLevel) {
+		return std::min(lz4MtContext->minCompressionLevel, level);
+	}
+	return level;
+}
+
+
 struct Params {
 	Params(const Lz4MtContext* lz4MtContext, const Lz4MtStreamDescriptor* sd)
 		: nBlockMaximumSize	 (getBlockSize(sd->bd.blockMaximumSize))
 		, blockCheckSumBytes (sd->flg.blockChecksum ? 4 : 0)
 		, streamChecksum	 (0 != sd->flg.streamChecksum)
 		, blockIndependence	 (0 != sd->flg.blockIndependence)
-		, singleThread		 (0 != (lz4MtContext->mode & LZ4MT_MODE_SEQUENTIAL))
-		, nPool				 (singleThread ? 1 : Lz4Mt::getHardwareConcurrency() + 1)
-		, launch			 (singleThread ? Lz4Mt::launch::deferred : std::launch::async)
+		, legacyFormat		 (false)
+		, store				 (0 != (lz4MtContext->mode & LZ4MT_MODE_STORE))
+		, probe				 (0 != lz4MtContext->incompressibleProbe)
+		, minSavings		 (std::min(std::max(lz4MtContext->minSavings, 0), 99))
+		, minLevel			 (getMinLevel(lz4MtContext))
+		, hcTimeLimit		 (std::max(lz4MtContext->hcTimeLimit, 0))
+		, dictionary		 (getDictionary(lz4MtContext, sd))
+		, nThread			 (getThreadCount(lz4MtContext, nBlockMaximumSize))
+		, nWindow			 (getWindowSize(lz4MtContext, nThread, nBlockMaximumSize))
+		, nPool				 (nWindow)
+	{}
+
+	// Legacy format : independent 8 MiB blocks, no checksum, no EOS.
+	explicit Params(const Lz4MtContext* lz4MtContext)
+		: nBlockMaximumSize	 (LZ4S_LEGACY_BLOCKSIZE)
+		, blockCheckSumBytes (0)
+		, streamChecksum	 (false)
+		, blockIndependence	 (true)
+		, legacyFormat		 (true)
+		, store				 (false)
+		, probe				 (false)
+		, minSavings		 (0)
+		, minLevel			 (getMinLevel(lz4MtContext))
+		, hcTimeLimit		 (std::max(lz4MtContext->hcTimeLimit, 0))
+		, dictionary		 (nullptr)
+		, nThread			 (getThreadCount(lz4MtContext, nBlockMaximumSize))
+		, nWindow			 (getWindowSize(lz4MtContext, nThread, nBlockMaximumSize))
+		, nPool				 (nWindow)
 	{}
 
 	int nBlockMaximumSize;
 	int blockCheckSumBytes;
 	bool streamChecksum;
 	bool blockIndependence;
-	bool singleThread;
+	bool legacyFormat;
+	bool store;				// Every block is written uncompressed
+	bool probe;				// Blocks which look incompressible are not compressed
+	int minSavings;			// Percent, 0 - 99
+	int minLevel;			// Lowest level of adaptiveLevel, compressionLevel when it's off
+	int hcTimeLimit;		// Milliseconds of HC for one block, 0 : unlimited
+	const Lz4MtDictionary* dictionary;	// nullptr : none
+	unsigned nThread;
+	unsigned nWindow;		// Maximum number of blocks in flight
 	unsigned nPool;
-	Lz4Mt::launch::Type launch;
 };
 
 
+// Workers and buffer budget of one lz4mtCompress() / lz4mtDecompress() call.
+// Jobs go to the shared engine when Lz4MtContext::engine is set, otherwise
+// to a private thread pool.
+//
+// With Lz4MtContext::numaPlacement, there is one queue per NUMA node of the
+// workers, and block i belongs to node slot (i % nodeCount()).
+class Session {
+public:
+	Session(const Lz4MtContext* lz4MtContext, unsigned nThread)
+		: engine(getEngine(lz4MtContext))
+		, ownThreadPool(engine ? nullptr : new Lz4Mt::ThreadPool(
+			  nThread, getCpuList(lz4MtContext)))
+		, ownBudget(getMemoryBudget(lz4MtContext)
+			? new Lz4Mt::Budget(getMemoryBudget(lz4MtContext)) : nullptr)
+		, nodes()
+		, queues()
+	{
+		auto& tp = engine ? engine->threadPool : *ownThreadPool;
+		const auto weight = engine ? static_cast<unsigned>(std::max(lz4MtContext->engineWeight, 1)) : 1;
+		if(lz4MtContext->numaPlacement && tp.nodes().size() > 1) {
+			nodes = tp.nodes();
+		} else {
+			nodes.push_back(-1);
+		}
+		for(const auto node : nodes) {
+			queues.emplace_back(new Lz4Mt::ThreadPool::Queue(tp, weight, node));
+		}
+	}
+
+	Lz4Mt::ThreadPool& threadPool() const {
+		return queues.front()->pool();
+	}
+
+	size_t nodeCount() const {
+		return nodes.size();
+	}
+
+	// NUMA node of node slot 'slot', or -1 (any).
+	int node(size_t slot) const {
+		return nodes[slot];
+	}
+
+	void post(uint64_t i, Lz4Mt::ThreadPool::Task task) {
+		queues[i % queues.size()]->post(std::move(task));
+	}
+
+	void acquire(uint64_t size) {
+		if(ownBudget) {
+			ownBudget->acquire(size);
+		}
+		if(engine) {
+			engine->budget.acquire(size);
+		}
+	}
+
+	void release(uint64_t size) {
+		if(engine) {
+			engine->budget.release(size);
+		}
+		if(ownBudget) {
+			ownBudget->release(size);
+		}
+	}
+
+private:
+	Session(const Session&);
+	const Session& operator=(const Session&);
+
+	Lz4MtEngine* engine;
+	const std::unique_ptr<Lz4Mt::ThreadPool> ownThreadPool;
+	const std::unique_ptr<Lz4Mt::Budget> ownBudget;		// nullptr : unlimited
+	std::vector<int> nodes;
+	std::vector<std::unique_ptr<Lz4Mt::ThreadPool::Queue>> queues;
+};
+
+
+// One MemPool per node slot of the Session.  Block i uses pools[i].
+class NodePools {
+public:
+	NodePools(Ctx& ctx, const Session& session, size_t elementSize, size_t elementCount)
+		: pools()
+	{
+		const auto n = session.nodeCount();
+		for(size_t i = 0; i < n; ++i) {
+			pools.emplace_back(new Lz4Mt::MemPool(
+				  elementSize, (elementCount + n - 1) / n, session.node(i)
+				, ctx.poolCounters(), ctx.hugePages(), ctx.poolAllocator()));
+		}
+	}
+
+	Lz4Mt::MemPool& operator[](uint64_t i) {
+		return *pools[i % pools.size()];
+	}
+
+private:
+	NodePools(const NodePools&);
+	const NodePools& operator=(const NodePools&);
+
+	std::vector<std::unique_ptr<Lz4Mt::MemPool>> pools;
+};
+
+
+// Blocks handed over to jobs, for a CommitRing of 'nSlot' slots.  Block i
+// uses slot (i % nSlot), which is free again by the time the ring lets
+// block (i + nSlot) start, so there's no Block to allocate per block.
+// A slot still holds whatever the ring didn't move out of it, so fill it
+// only after '*slot = Block();'.
+template<typename Block>
+class HandoffSlots {
+public:
+	explicit HandoffSlots(size_t nSlot)
+		: slots(nSlot)
+	{}
+
+	Block* operator[](uint64_t i) {
+		return &slots[i % slots.size()];
+	}
+
+private:
+	HandoffSlots(const HandoffSlots&);
+	const HandoffSlots& operator=(const HandoffSlots&);
+
+	std::vector<Block> slots;
+};
+
+
+// LZ4 / LZ4HC stream state for block dependent (-BD) compression.
+//
+// compress() continues the stream : the preceding input must stay where
+// it was, unmodified, until the next call.  Since blocks are at least
+// 64 KiB, the preceding block alone is the whole history, so blocks can
+// live in separate buffers and nothing has to be slid or saved.
+//
+// The state lives in 'state' (getStateSize() bytes), which is borrowed.
 class BlockDependentCompressor {
 public:
-	BlockDependentCompressor(int compressionLevel, const char* inputBuffer)
-		: isHc(compressionLevel >= 3)
-		, lz4Ctx(new char[
-			isHc ? LZ4_sizeofStreamStateHC()
-			     : LZ4_sizeofStreamState()
-		  ])
-		, compressFunction(
-			isHc ? LZ4_compressHC_limitedOutput_continue
-			     : LZ4_compress_limitedOutput_continue
-		  )
-		, translateFunction(
-			isHc ? LZ4_slideInputBufferHC
-			     : LZ4_slideInputBuffer
-		)
+	BlockDependentCompressor(void* state, int compressionLevel)
+		: compressionLevel(compressionLevel)
+		, isHc(compressionLevel >= 3)
+		, acceleration(compressionLevel < 0 ? -compressionLevel : 1)
+		, lz4Ctx(static_cast<char*>(state))
 	{
-		if(isHc) {
-			LZ4_resetStreamStateHC(lz4Ctx.get(), inputBuffer);
+		reset();
+	}
+
+	static size_t getStateSize(int compressionLevel) {
+		return compressionLevel >= 3 ? sizeof(LZ4_streamHC_t) : sizeof(LZ4_stream_t);
+	}
+
+	// Start a new stream, which follows 'dictionary' if any.
+	void reset(const Lz4MtDictionary* dictionary = nullptr) {
+		if(dictionary) {
+			dictionary->loadState(lz4Ctx, compressionLevel);
+		} else if(isHc) {
+			LZ4_resetStreamHC(reinterpret_cast<LZ4_streamHC_t*>(lz4Ctx), compressionLevel);
 		} else {
-			LZ4_resetStreamState(lz4Ctx.get(), inputBuffer);
+			LZ4_resetStream(reinterpret_cast<LZ4_stream_t*>(lz4Ctx));
 		}
 	}
 
 	int compress(const char* source, char* dest, int inputSize, int maxOutputSize) {
-		return compressFunction(lz4Ctx.get(), source, dest, inputSize, maxOutputSize);
+		if(isHc) {
+			return LZ4_compress_HC_continue(
+				reinterpret_cast<LZ4_streamHC_t*>(lz4Ctx), source, dest, inputSize, maxOutputSize);
+		} else {
+			return LZ4_compress_fast_continue(
+				  reinterpret_cast<LZ4_stream_t*>(lz4Ctx), source, dest, inputSize, maxOutputSize
+				, acceleration);
+		}
 	}
 
-	char* translate() {
-		return translateFunction(lz4Ctx.get());
+	// Compress 'source' as if it followed 'dict' (the preceding raw input)
+	// in the same stream.  Only the last 64 KiB of 'dict' are used.
+	int compressWithDict(
+		  const char* dict, int dictSize
+		, const char* source, char* dest, int inputSize, int maxOutputSize
+	) {
+		reset();
+		if(isHc) {
+			LZ4_loadDictHC(reinterpret_cast<LZ4_streamHC_t*>(lz4Ctx), dict, dictSize);
+		} else {
+			LZ4_loadDict(reinterpret_cast<LZ4_stream_t*>(lz4Ctx), dict, dictSize);
+		}
+		return compress(source, dest, inputSize, maxOutputSize);
 	}
 
 private:
+	BlockDependentCompressor(const BlockDependentCompressor&);
+	const BlockDependentCompressor& operator=(const BlockDependentCompressor&);
+
+	const int compressionLevel;
 	const bool isHc;
-	const std::unique_ptr<char[]> lz4Ctx;
-	const std::function<int(void*, const char*, char*, int, int)> compressFunction;
-	const std::function<char*(void*)> translateFunction;
+	const int acceleration;
+	char* const lz4Ctx;
 };
 
 
+// Scratch space of one compressing worker : Lz4MtContext::compress()'s
+// state, or a BlockDependentCompressor.
+size_t getCompressStateSize(const Ctx& ctx) {
+	return std::max(
+		  ctx.compressStateSize()
+		, BlockDependentCompressor::getStateSize(ctx.compressionLevel()));
+}
+
+
 Lz4MtResult
 makeHeader(Ctx& ctx, const Lz4MtStreamDescriptor* sd)
 {
@@ -356,7 +899,7 @@ makeHeader(Ctx& ctx, const Lz4MtStreamDescriptor* sd)
 	}
 
 	const auto sumSize = static_cast<int>(p - sumBegin);
-	const auto h = Lz4Mt::Xxh32(sumBegin, sumSize, LZ4S_CHECKSUM_SEED).digest();
+	const auto h = Lz4Mt::Xxh32::hash(sumBegin, sumSize, LZ4S_CHECKSUM_SEED);
 	*p++ = static_cast<char>(getCheckBits_FromXXH(h));
 	assert(p <= std::end(d));
 
@@ -369,170 +912,438 @@ makeHeader(Ctx& ctx, const Lz4MtStreamDescriptor* sd)
 }
 
 
-Lz4MtResult
-compress(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
-{
-	Lz4Mt::MemPool srcBufferPool(params.nBlockMaximumSize, params.nPool);
-	Lz4Mt::MemPool dstBufferPool(params.nBlockMaximumSize, params.nPool);
-	std::vector<std::future<void>> futures;
-
-	const auto f =
-		[&futures, &dstBufferPool, &xxhStream, &params, &ctx]
-		(int i, Lz4Mt::MemPool::Buffer* srcRawPtr, int srcSize)
-	{
-		BufferPtr src(srcRawPtr);
-		if(ctx.error()) {
-			return;
-		}
+// Largest compressed size of a 'srcSize' bytes block which is worth
+// keeping : it saves at least params.minSavings percent.
+int getMaxCompressedSize(const Params& params, int srcSize) {
+	const auto savings = static_cast<int>(
+		static_cast<int64_t>(srcSize) * params.minSavings / 100);
+	return srcSize - std::max(savings, 1);
+}
 
-		const auto* srcPtr = src->data();
-		BufferPtr dst(dstBufferPool.alloc());
-		auto* cmpPtr = dst->data();
-		const auto cmpSize = ctx.compress(srcPtr, cmpPtr, srcSize, srcSize);
-		const bool incompressible = (cmpSize <= 0);
-		const auto* cPtr  = incompressible ? srcPtr  : cmpPtr;
-		const auto  cSize = incompressible ? srcSize : cmpSize;
 
-		std::future<uint32_t> futureBlockHash;
-		if(params.blockCheckSumBytes) {
-			futureBlockHash = std::async(params.launch, [=] {
-				return Lz4Mt::Xxh32(cPtr, cSize, LZ4S_CHECKSUM_SEED).digest();
-			});
-		}
+// Level of a block under Lz4MtContext::hcTimeLimit.  LZ4 HC can't be
+// interrupted, so a few slices of the block (1/64 of it in total) are
+// compressed first, and the block falls back to the fast codec when they
+// project an overrun.  'dstPtr' (at least srcSize bytes) is used as
+// scratch space.
+//
+// NOTE : Slices smaller than MIN_SLICE_SIZE time too little to project
+//        from, so blocks smaller than 1 MiB (-B6) get no trial.
+int
+getTimedLevel(Ctx& ctx, const Params& params, int level, void* state
+	, const char* srcPtr, int srcSize, char* dstPtr)
+{
+	const int SAMPLE_RATIO = 64;
+	const int N_SLICE = 4;
+	const int MIN_SLICE_SIZE = 4 * 1024;
+	const int FALLBACK_LEVEL = 1;
+	if(level < 3 || 0 == params.hcTimeLimit
+	   || srcSize < SAMPLE_RATIO * N_SLICE * MIN_SLICE_SIZE)
+	{
+		return level;
+	}
 
-		if(incompressible) {
-			dst.reset();
-		}
+	const int sliceSize = srcSize / SAMPLE_RATIO / N_SLICE;
+	const auto t0 = Clock::now();
+	const int step = (srcSize - sliceSize) / (N_SLICE - 1);
+	for(int i = 0; i < N_SLICE; ++i) {
+		ctx.compress(state, srcPtr + i * step, dstPtr, sliceSize, sliceSize, level);
+	}
+	const auto t = static_cast<double>((Clock::now() - t0).count());
+	const auto limit = static_cast<double>(std::chrono::duration_cast<Clock::duration>(
+		std::chrono::milliseconds(params.hcTimeLimit)).count());
+	if(t * srcSize / (N_SLICE * sliceSize) > limit) {
+		ctx.countHcFallback();
+		return FALLBACK_LEVEL;
+	}
+	return level;
+}
 
-		if(i > 0) {
-			futures[i-1].wait();
-		}
 
-		std::future<void> futureStreamHash;
-		if(params.streamChecksum) {
-			futureStreamHash = std::async(params.launch, [=, &xxhStream] {
-				xxhStream.update(srcPtr, srcSize);
-			});
-		}
+// Compress one block of a stream described by 'params'.  'state' is
+// getCompressStateSize() bytes of scratch space.  prevPtr is the preceding
+// raw block of a -BD stream (nullptr : first block).  Returns the
+// compressed size, or <= 0 when the block should be stored uncompressed.
+int
+compressBlock(Ctx& ctx, const Params& params, int level, void* state
+	, const char* srcPtr, int srcSize, char* dstPtr, int dstSize
+	, const char* prevPtr, int prevSize)
+{
+	// NOTE : A block which follows a dictionary or the preceding block
+	//        may match it even when it looks incompressible on its own,
+	//        so only blocks without history are probed.
+	if(params.probe && !params.legacyFormat
+	   && nullptr == prevPtr && !params.dictionary
+	   && Lz4Mt::isIncompressible(state, srcPtr, srcSize))
+	{
+		ctx.countProbedRawBlock();
+		return 0;
+	}
+	level = getTimedLevel(ctx, params, level, state, srcPtr, srcSize, dstPtr);
+	ctx.countLevel(level);
 
-		if(incompressible) {
-			ctx.writeU32(makeIncompless(cSize));
-			ctx.writeBin(srcPtr, srcSize);
-		} else {
-			ctx.writeU32(cSize);
-			ctx.writeBin(cmpPtr, cmpSize);
+	const auto t0 = Clock::now();
+	const auto cmpSize = [&]() -> int {
+		if(params.legacyFormat) {
+			return ctx.compress(state, srcPtr, dstPtr, srcSize, dstSize, level);
 		}
-
-		if(futureBlockHash.valid()) {
-			ctx.writeU32(futureBlockHash.get());
+		const auto maxSize = getMaxCompressedSize(params, srcSize);
+		if(params.blockIndependence && !params.dictionary) {
+			return ctx.compress(state, srcPtr, dstPtr, srcSize, maxSize, level);
 		}
-
-		if(futureStreamHash.valid()) {
-			futureStreamHash.wait();
+		BlockDependentCompressor bdc(state, level);
+		if(params.blockIndependence || nullptr == prevPtr) {
+			// NOTE : Every independent block, and the first block of
+			//        a -BD stream, follows the preset dictionary.
+			bdc.reset(params.dictionary);
+			return bdc.compress(srcPtr, dstPtr, srcSize, maxSize);
 		}
-	};
+		const int dictSize = std::min(prevSize, 64 * 1024);
+		return bdc.compressWithDict(
+			  prevPtr + prevSize - dictSize, dictSize
+			, srcPtr, dstPtr, srcSize, maxSize);
+	}();
+	if(level >= 3 && params.hcTimeLimit > 0
+	   && Clock::now() - t0 > std::chrono::milliseconds(params.hcTimeLimit))
+	{
+		ctx.countHcOverrun();
+	}
+	return cmpSize;
+}
 
-	for(int i = 0;; ++i) {
-		BufferPtr src(srcBufferPool.alloc());
-		auto* srcPtr = src->data();
-		const auto srcSize = src->size();
-		const auto readSize = ctx.read(srcPtr, static_cast<int>(srcSize));
 
-		if(0 == readSize) {
+// Inputs smaller than one block are compressed inline on the calling
+// thread : no Session, no pools and no worker handoff.  Returns false
+// when the input fills a block; what was read is given back to 'ctx'
+// for compress().
+bool
+compressSmall(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
+{
+	const auto blockSize = params.nBlockMaximumSize;
+	ScratchBuffer src(ctx.allocator(), blockSize);
+	if(nullptr == src.get()) {
+		ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+		return true;
+	}
+	int srcSize = 0;
+	for(;;) {
+		const auto readSize = ctx.read(src.get() + srcSize, blockSize - srcSize);
+		if(readSize <= 0) {
 			break;
 		}
-
-		if(params.singleThread) {
-			f(0, src.release(), readSize);
-		} else {
-			futures.emplace_back(std::async(params.launch, f, i, src.release(), readSize));
+		srcSize += readSize;
+		if(blockSize == srcSize) {
+			ctx.unread(std::move(src), srcSize);
+			return false;
 		}
 	}
-
-	for(auto& e : futures) {
-		e.wait();
+	if(0 == srcSize) {
+		return true;
 	}
 
-	return LZ4MT_RESULT_OK;
+	ScratchBuffer dst;
+	int cmpSize = 0;
+	if(! params.store) {
+		const auto dstSize = params.legacyFormat ? ctx.compressBound(srcSize) : srcSize;
+		dst = ScratchBuffer(ctx.allocator(), dstSize);
+		ScratchBuffer state(ctx.allocator(), getCompressStateSize(ctx));
+		if(nullptr == dst.get() || nullptr == state.get()) {
+			ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+			return true;
+		}
+		cmpSize = compressBlock(
+			  ctx, params, ctx.compressionLevel(), state.get()
+			, src.get(), srcSize, dst.get(), dstSize, nullptr, 0);
+	}
+	if(params.legacyFormat && cmpSize <= 0) {
+		ctx.quit(LZ4MT_RESULT_ERROR);
+		return true;
+	}
+	const bool incompressible = (cmpSize <= 0);
+	const auto* cPtr  = incompressible ? src.get() : dst.get();
+	const auto  cSize = incompressible ? srcSize   : cmpSize;
+
+	ctx.writeU32(incompressible ? makeIncompless(srcSize) : cmpSize);
+	ctx.writeBin(cPtr, cSize);
+	if(params.blockCheckSumBytes) {
+		ctx.writeU32(Lz4Mt::Xxh32::hash(cPtr, cSize, LZ4S_CHECKSUM_SEED));
+	}
+	if(params.streamChecksum) {
+		xxhStream.update(src.get(), srcSize);
+	}
+	return true;
 }
 
 
-Lz4MtResult
-compressBlockDependency(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
-{
-	const auto inputBufferSize = [&]() -> size_t {
-		// NOTE for "-> size_t" :
-		//		It's a workaround for g++-4.6's strange warning.
-		const auto s = params.nBlockMaximumSize + 65536;
-		return std::max(s, static_cast<decltype(s)>(LZ4S_MIN_STREAM_BUFSIZE));
-	}();
+// Compression level of each block for Lz4MtContext::adaptiveLevel.
+//
+// Workers report how long they compressed, and the writer how long it
+// wrote.  Every nWorker blocks the reader compares both with the elapsed
+// time.  When the writer is busy and the workers have slack, the level
+// goes one step up.  In the opposite case it goes one step down.  When
+// the input is the bottleneck, both have slack and the level stays.
+class AdaptiveLevel {
+public:
+	AdaptiveLevel(int minLevel, int maxLevel, unsigned nWorker)
+		: levels()
+		, index(0)
+		, nWorker(std::max(nWorker, 1u))
+		, nBlock(0)
+		, t0(Clock::now())
+		, compressTicks(0)
+		, writeTicks(0)
+		, lastCompressTicks(0)
+		, lastWriteTicks(0)
+	{
+		for(int l = minLevel; l < maxLevel; ++l) {
+			// NOTE : Levels -1 to 2 are one step, acceleration 1.
+			const auto x = (l >= -1 && l <= 2) ? 1 : l;
+			if(levels.empty() || levels.back() != x) {
+				levels.push_back(x);
+			}
+		}
+		if(! levels.empty() && levels.back() == 1 && maxLevel <= 2) {
+			levels.pop_back();
+		}
+		levels.push_back(maxLevel);
+		index = levels.size() - 1;
+	}
 
-	const size_t nPool = 1;
-	Lz4Mt::MemPool srcBufferPool(inputBufferSize, nPool);
-	Lz4Mt::MemPool dstBufferPool(params.nBlockMaximumSize + LZ4S_CACHELINE, nPool);
+	// Level of the next block.  Called by the reader only.
+	int next() {
+		if(levels.size() > 1 && 0 == (++nBlock % nWorker)) {
+			adjust();
+		}
+		return levels[index];
+	}
 
-	const BufferPtr src(srcBufferPool.alloc());
-	const BufferPtr dst(dstBufferPool.alloc());
+	void addCompressTime(Clock::duration d) {
+		compressTicks += d.count();
+	}
 
-	auto* const srcBuf = src->data();
-	auto* const srcEnd = srcBuf + src->size();
-	auto* const dstBuf = dst->data();
+	void addWriteTime(Clock::duration d) {
+		writeTicks += d.count();
+	}
 
-	auto* in_start = srcBuf;
+private:
+	AdaptiveLevel(const AdaptiveLevel&);
+	const AdaptiveLevel& operator=(const AdaptiveLevel&);
+
+	void adjust() {
+		const double BUSY = 0.8;
+		const auto t = Clock::now();
+		const auto wall = static_cast<double>((t - t0).count());
+		if(wall <= 0.0) {
+			return;
+		}
+		const int64_t c = compressTicks;
+		const int64_t w = writeTicks;
+		const auto compressLoad = static_cast<double>(c - lastCompressTicks) / (wall * nWorker);
+		const auto writeLoad = static_cast<double>(w - lastWriteTicks) / wall;
+		t0 = t;
+		lastCompressTicks = c;
+		lastWriteTicks = w;
+
+		if(writeLoad > BUSY && compressLoad < BUSY) {
+			if(index + 1 < levels.size()) {
+				++index;
+			}
+		} else if(compressLoad > BUSY && writeLoad < BUSY) {
+			if(index > 0) {
+				--index;
+			}
+		}
+	}
 
-	BlockDependentCompressor bdc(ctx.compressionLevel(), srcBuf);
+	std::vector<int> levels;
+	size_t index;
+	const unsigned nWorker;
+	uint64_t nBlock;
+	Clock::time_point t0;
+	std::atomic<int64_t> compressTicks;
+	std::atomic<int64_t> writeTicks;
+	int64_t lastCompressTicks;
+	int64_t lastWriteTicks;
+};
 
-	for(;;) {
-		if((in_start + params.nBlockMaximumSize) > srcEnd) {
-			in_start = bdc.translate();
-		}
 
-		const auto inSize = ctx.read(in_start, params.nBlockMaximumSize);
-		if(0 == inSize) {
-			break;
+// Compress blocks in parallel.
+//
+// For block dependent streams (-BD), every block is compressed separately
+// with the tail of the preceding raw block loaded as dictionary.  That's
+// all what the decoder's 64 KiB prefix can refer to, so the output is an
+// ordinary block dependent stream.  The worker of block i therefore shares
+// the src buffer of block (i-1), and the src pool has one extra buffer per
+// node slot.  This is the only -BD path : without workers (SEQUENTIAL)
+// the same jobs run inline, and still nothing has to be slid.
+//
+// Legacy blocks are always stored compressed, so their dst buffers are
+// large enough for the worst case.
+//
+// In store mode (LZ4MT_MODE_STORE), workers only hash their block, and
+// neither dst buffers nor the preceding block are needed.
+Lz4MtResult
+compress(Ctx& ctx, const Params& params, Session& session, Lz4Mt::Xxh32& xxhStream)
+{
+	auto& threadPool = session.threadPool();
+	const uint64_t blockBudget = 2 * static_cast<uint64_t>(params.nBlockMaximumSize);
+	const bool keepPrev = !params.blockIndependence && !params.store;
+	const auto nSrcPool = params.nPool + (keepPrev ? session.nodeCount() : 0);
+	const auto dstSize = params.legacyFormat
+		? ctx.compressBound(params.nBlockMaximumSize)
+		: params.nBlockMaximumSize;
+	NodePools srcBufferPools(ctx, session, params.nBlockMaximumSize, nSrcPool);
+	NodePools dstBufferPools(ctx, session, dstSize, params.nPool);
+
+	// NOTE : A job borrows a compression state only while it compresses,
+	//        so there is one state per worker (and one for the caller,
+	//        which runs jobs without workers), reused across blocks.
+	Lz4Mt::MemPool statePool(getCompressStateSize(ctx), params.nThread + 1
+		, -1, nullptr, false, ctx.poolAllocator());
+	AdaptiveLevel adaptiveLevel(params.minLevel, ctx.compressionLevel(), params.nThread);
+
+	struct Block {
+		Block() : src(), dst(), srcSize(0), cmpSize(0), blockHash(0) {}
+		SharedBufferPtr src;
+		BufferPtr dst;			// nullptr : incompressible
+		int srcSize;
+		int cmpSize;
+		uint32_t blockHash;
+	};
+
+	const auto commit = [&session, &threadPool, &xxhStream, &params, &ctx, &adaptiveLevel, blockBudget]
+		(Block& b)
+	{
+		session.release(blockBudget);
+		if(ctx.error()) {
+			return;
 		}
 
+		const auto* srcPtr = b.src->data();
+		const auto srcSize = b.srcSize;
+
+		std::future<void> futureStreamHash;
 		if(params.streamChecksum) {
-			xxhStream.update(in_start, inSize);
+			futureStreamHash = threadPool.enqueueLeaf([=, &xxhStream] {
+				xxhStream.update(srcPtr, srcSize);
+			});
 		}
 
-		const auto outSize = bdc.compress(
-			  in_start
-			, dstBuf
-			, inSize
-			, inSize-1
-		);
+		const auto t0 = Clock::now();
+		if(b.dst) {
+			ctx.writeU32(b.cmpSize);
+			ctx.writeBin(b.dst->data(), b.cmpSize);
+		} else {
+			ctx.writeU32(makeIncompless(srcSize));
+			ctx.writeBin(srcPtr, srcSize);
+		}
+
+		if(params.blockCheckSumBytes) {
+			ctx.writeU32(b.blockHash);
+		}
+		adaptiveLevel.addWriteTime(Clock::now() - t0);
+
+		if(futureStreamHash.valid()) {
+			threadPool.wait(futureStreamHash);
+		}
+	};
+
+	Lz4Mt::CommitRing<Block> commitRing(params.nWindow, commit);
 
-		struct WriteStat {
-			int bytes;
-			int header;
-			char* ptr;
-		};
-		const auto writeStat = [&]() -> WriteStat {
-			// NOTE for "-> WriteStat" :
-			//		It's a workaround for g++-4.6's strange warning.
-			WriteStat ws = { 0 };
-			if(outSize > 0) {
-				ws.bytes	= outSize;
-				ws.header	= outSize;
-				ws.ptr		= dstBuf;
+	const auto f =
+		[&dstBufferPools, &statePool, &commitRing, &params, &ctx, &adaptiveLevel]
+		(uint64_t i, SharedBufferPtr src, SharedBufferPtr prev, int srcSize, int prevSize, int level)
+	{
+		Block b;
+		b.src = std::move(src);
+		b.srcSize = srcSize;
+
+		if(! ctx.error() && params.store) {
+			const auto* srcPtr = b.src->data();
+			ctx.countNumaPlacement(srcPtr);
+			if(params.blockCheckSumBytes) {
+				b.blockHash = Lz4Mt::Xxh32::hash(srcPtr, srcSize, LZ4S_CHECKSUM_SEED);
+			}
+		} else if(! ctx.error()) {
+			const auto* srcPtr = b.src->data();
+			ctx.countNumaPlacement(srcPtr);
+			BufferPtr dst(dstBufferPools[i].alloc());
+			BufferPtr state(dst ? statePool.alloc() : BufferPtr());
+			if(! state) {
+				ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
 			} else {
-				ws.bytes	= inSize;
-				ws.header	= makeIncompless(inSize);
-				ws.ptr		= in_start;
+				auto* cmpPtr = dst->data();
+				const auto t0 = Clock::now();
+				const auto cmpSize = compressBlock(
+					  ctx, params, level, state->data()
+					, srcPtr, srcSize, cmpPtr, static_cast<int>(dst->size())
+					, prev.get() ? prev->data() : nullptr, prevSize);
+				state.reset();
+				adaptiveLevel.addCompressTime(Clock::now() - t0);
+				prev.reset();
+				if(params.legacyFormat && cmpSize <= 0) {
+					ctx.quit(LZ4MT_RESULT_ERROR);
+				}
+				const bool incompressible = (cmpSize <= 0);
+				const auto* cPtr  = incompressible ? srcPtr  : cmpPtr;
+				const auto  cSize = incompressible ? srcSize : cmpSize;
+
+				if(params.blockCheckSumBytes) {
+					b.blockHash = Lz4Mt::Xxh32::hash(cPtr, cSize, LZ4S_CHECKSUM_SEED);
+				}
+
+				if(! incompressible) {
+					b.dst = std::move(dst);
+					b.cmpSize = cmpSize;
+				}
 			}
-			return ws;
-		} ();
+		}
 
-		ctx.writeU32(writeStat.header);
-		ctx.writeBin(writeStat.ptr, writeStat.bytes);
-		if(params.blockCheckSumBytes) {
-			const auto xh = Lz4Mt::Xxh32(writeStat.ptr, writeStat.bytes, LZ4S_CHECKSUM_SEED).digest();
-			ctx.writeU32(xh);
+		// NOTE : 'prev' must go before the commit, which may be the last,
+		//        also when the block wasn't compressed.
+		prev.reset();
+		commitRing.put(i, std::move(b));
+	};
+
+	SharedBufferPtr prev;
+	int prevSize = 0;
+	uint64_t nBlock = 0;
+	for(;; ++nBlock) {
+		commitRing.waitSlot(nBlock);
+		if(ctx.isQuit()) {
+			break;
+		}
+		session.acquire(blockBudget);
+		SharedBufferPtr src(srcBufferPools[nBlock].alloc());
+		if(nullptr == src.get()) {
+			session.release(blockBudget);
+			ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+			break;
+		}
+		auto* srcPtr = src->data();
+		const auto srcSize = src->size();
+		const auto readSize = ctx.read(srcPtr, static_cast<int>(srcSize));
+
+		if(0 == readSize) {
+			session.release(blockBudget);
+			break;
 		}
 
-		in_start += inSize;
+		// NOTE : The job must not keep its buffers after f() returned,
+		//        since the pools may be gone by the time it's destroyed.
+		const auto level = adaptiveLevel.next();
+		session.post(nBlock, [=]() mutable {
+			f(nBlock, std::move(src), std::move(prev), readSize, prevSize, level);
+		});
+
+		if(keepPrev) {
+			prev = std::move(src);
+			prevSize = readSize;
+		}
 	}
+	prev.reset();
+
+	commitRing.wait(nBlock);
 
 	return LZ4MT_RESULT_OK;
 }
@@ -576,7 +1387,7 @@ readHeader(Ctx& ctx, Lz4MtStreamDescriptor* sd)
 	}
 
 	const auto sumSize   = static_cast<int>(p - sumBegin);
-	const auto calHash32 = Lz4Mt::Xxh32(sumBegin, sumSize, LZ4S_CHECKSUM_SEED).digest();
+	const auto calHash32 = Lz4Mt::Xxh32::hash(sumBegin, sumSize, LZ4S_CHECKSUM_SEED);
 	const auto calHash   = static_cast<char>(getCheckBits_FromXXH(calHash32));
 	const auto srcHash   = *p++;
 
@@ -590,120 +1401,228 @@ readHeader(Ctx& ctx, Lz4MtStreamDescriptor* sd)
 }
 
 
-bool
-decompress(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
-{
-	Lz4Mt::MemPool srcBufferPool(params.nBlockMaximumSize, params.nPool);
-	Lz4Mt::MemPool dstBufferPool(params.nBlockMaximumSize, params.nPool);
-	std::vector<std::future<void>> futures;
+// Decoder of block independent frames.
+//
+// Blocks of consecutive frames share one commit ring, so the caller goes
+// on reading (and workers go on decoding) the next frames while earlier
+// ones are still being written.  Each frame has its own stream hash, which
+// is verified by a frame end entry committed after the frame's last block.
+class IndependentDecoder {
+public:
+	IndependentDecoder(Ctx& ctx, Session& session, unsigned nWindow)
+		: ctx(ctx)
+		, session(session)
+		, nPool(nWindow)
+		, srcBufferPools()
+		, dstBufferPools()
+		, commitRing(nPool, [this](Block& b) { commit(b); })
+		, handoff(nPool)
+		, nBlock(0)
+	{}
 
-	const auto f =
-		[&futures, &dstBufferPool, &xxhStream, &params, &ctx]
-		(int i, Lz4Mt::MemPool::Buffer* srcRaw, bool incompressible, uint32_t blockChecksum)
-	{
-		BufferPtr src(srcRaw);
-		if(ctx.error() || ctx.isQuit()) {
-			return;
-		}
+	~IndependentDecoder() {
+		drain();
+	}
 
-		const auto* srcPtr = src->data();
-		const auto srcSize = static_cast<int>(src->size());
+	// Read blocks and stream checksum of a frame.  Returns false when the
+	// frame ended without EOS.
+	bool decodeFrame(const Params& params);
 
-		std::future<uint32_t> futureBlockHash;
-		if(params.blockCheckSumBytes) {
-			futureBlockHash = std::async(params.launch, [=] {
-				return Lz4Mt::Xxh32(srcPtr, srcSize, LZ4S_CHECKSUM_SEED).digest();
-			});
+	// Wait until every block has been committed.
+	void drain() {
+		commitRing.wait(nBlock);
+	}
+
+	// Maximum number of blocks in flight.
+	unsigned windowSize() const {
+		return nPool;
+	}
+
+private:
+	IndependentDecoder(const IndependentDecoder&);
+	const IndependentDecoder& operator=(const IndependentDecoder&);
+
+	typedef std::shared_ptr<Lz4Mt::Xxh32> Xxh32Ptr;
+
+	struct Block {
+		Block()
+			: src(), dst(), decSize(0), budget(0), xxhStream()
+			, frameEnd(false), streamChecksum(0)
+		{}
+		BufferPtr src;
+		BufferPtr dst;			// nullptr : incompressible
+		int decSize;
+		uint64_t budget;
+		Xxh32Ptr xxhStream;		// nullptr : no stream checksum
+		bool frameEnd;
+		uint32_t streamChecksum;
+	};
+
+	void commit(Block& b);
+	void decodeBlock(uint64_t i, Block* b, NodePools& dstPools
+		, const Params& params, bool incompressible, uint32_t blockChecksum);
+	typedef std::map<int, std::unique_ptr<NodePools>> PoolMap;
+	NodePools& getPools(PoolMap& pools, int blockSize);
+
+	Ctx& ctx;
+	Session& session;
+	const unsigned nPool;
+	PoolMap srcBufferPools;		// for each block maximum size
+	PoolMap dstBufferPools;
+	Lz4Mt::CommitRing<Block> commitRing;
+	HandoffSlots<Block> handoff;
+	uint64_t nBlock;
+};
+
+
+void IndependentDecoder::commit(Block& b) {
+	session.release(b.budget);
+	if(ctx.error() || ctx.isQuit()) {
+		return;
+	}
+
+	if(b.frameEnd) {
+		if(b.xxhStream && b.xxhStream->digest() != b.streamChecksum) {
+			ctx.quit(LZ4MT_RESULT_STREAM_CHECKSUM_MISMATCH);
 		}
+		return;
+	}
 
-		if(incompressible) {
-			if(i > 0) {
-				futures[i-1].wait();
-			}
+	const bool incompressible = !b.dst;
+	const auto* outPtr = incompressible ? b.src->data() : b.dst->data();
+	const auto outSize = incompressible ? static_cast<int>(b.src->size()) : b.decSize;
 
-			std::future<void> futureStreamHash;
-			if(params.streamChecksum) {
-				futureStreamHash = std::async(
-					  params.launch
-					, [&xxhStream, srcPtr, srcSize] {
-						xxhStream.update(srcPtr, srcSize);
-					}
-				);
-			}
-			if(! ctx.writeBin(srcPtr, srcSize)) {
-				ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK);
-				return;
+	auto& threadPool = session.threadPool();
+	std::future<void> futureStreamHash;
+	if(auto* xxhStream = b.xxhStream.get()) {
+		futureStreamHash = threadPool.enqueueLeaf(
+			[xxhStream, outPtr, outSize] {
+				xxhStream->update(outPtr, outSize);
 			}
-			if(futureStreamHash.valid()) {
-				futureStreamHash.wait();
-			}
-		} else {
-			BufferPtr dst(dstBufferPool.alloc());
+		);
+	}
+	if(! ctx.writeBin(outPtr, outSize)) {
+		ctx.quit(incompressible
+			? LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK
+			: LZ4MT_RESULT_CANNOT_WRITE_DECODED_BLOCK);
+	}
+	if(futureStreamHash.valid()) {
+		threadPool.wait(futureStreamHash);
+	}
+}
 
-			auto* dstPtr = dst->data();
-			const auto dstSize = dst->size();
-			const auto decSize = ctx.decompress(
-				srcPtr, dstPtr, srcSize, static_cast<int>(dstSize));
+
+void IndependentDecoder::decodeBlock(
+	  uint64_t i, Block* b, NodePools& dstPools
+	, const Params& params, bool incompressible, uint32_t blockChecksum
+) {
+	const auto* srcPtr = b->src->data();
+	const auto srcSize = static_cast<int>(b->src->size());
+
+	if(ctx.error() || ctx.isQuit()) {
+		// NOTE : Even a skipped block has to fill its slot.
+	} else if(params.blockCheckSumBytes
+		&& Lz4Mt::Xxh32::hash(srcPtr, srcSize, LZ4S_CHECKSUM_SEED) != blockChecksum
+	) {
+		ctx.quit(LZ4MT_RESULT_BLOCK_CHECKSUM_MISMATCH);
+	} else if(! incompressible) {
+		ctx.countNumaPlacement(srcPtr);
+		BufferPtr dst(dstPools[i].alloc());
+		if(! dst) {
+			ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+		} else {
+			const auto dstSize = static_cast<int>(dst->size());
+			const auto* dict = params.dictionary;
+			const auto decSize = dict
+				? LZ4_decompress_safe_usingDict(
+					srcPtr, dst->data(), srcSize, dstSize, dict->data(), dict->size())
+				: ctx.decompress(srcPtr, dst->data(), srcSize, dstSize);
 			if(decSize < 0) {
 				ctx.quit(LZ4MT_RESULT_DECOMPRESS_FAIL);
-				return;
+			} else {
+				b->dst = std::move(dst);
+				b->decSize = decSize;
 			}
+		}
+	}
 
-			if(i > 0) {
-				futures[i-1].wait();
-			}
+	commitRing.put(i, std::move(*b));
+}
 
-			std::future<void> futureStreamHash;
-			if(params.streamChecksum) {
-				futureStreamHash = std::async(
-					  params.launch
-					, [&xxhStream, dstPtr, decSize] {
-						xxhStream.update(dstPtr, decSize);
-					}
-				);
+
+NodePools& IndependentDecoder::getPools(PoolMap& pools, int blockSize) {
+	auto& p = pools[blockSize];
+	if(! p) {
+		p.reset(new NodePools(ctx, session, blockSize, nPool));
+	}
+	return *p;
+}
+
+
+bool IndependentDecoder::decodeFrame(const Params& params) {
+	// NOTE : Legacy blocks are always compressed, and may be a bit larger
+	//        than the block size.
+	const auto srcBufferSize = params.legacyFormat
+		? ctx.compressBound(params.nBlockMaximumSize)
+		: params.nBlockMaximumSize;
+	auto& srcPools = getPools(srcBufferPools, srcBufferSize);
+	auto& dstPools = getPools(dstBufferPools, params.nBlockMaximumSize);
+	const uint64_t blockBudget = 2 * static_cast<uint64_t>(params.nBlockMaximumSize);
+	const Xxh32Ptr xxhStream(
+		params.streamChecksum ? new Lz4Mt::Xxh32(LZ4S_CHECKSUM_SEED) : nullptr);
+
+	bool eos = false;
+	while(!eos && !ctx.isQuit() && !ctx.readEof()) {
+		uint32_t srcBits = 0;
+		if(params.legacyFormat) {
+			// NOTE : A legacy frame ends at the end of input, or at anything
+			//        which can't be a block size (e.g. the next magic number).
+			const auto n = ctx.readU32(srcBits);
+			if(0 == n) {
+				eos = true;
+				continue;
 			}
-			if(! ctx.writeBin(dstPtr, decSize)) {
-				ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_DECODED_BLOCK);
-				return;
+			if(sizeof(srcBits) != n) {
+				ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_SIZE);
+				continue;
 			}
-
-			if(futureStreamHash.valid()) {
-				futureStreamHash.wait();
+			if(srcBits > static_cast<uint32_t>(srcBufferSize)) {
+				ctx.readSeek(-4);
+				eos = true;
+				continue;
 			}
-		}
-
-		if(futureBlockHash.valid()) {
-			auto bh = futureBlockHash.get();
-			if(bh != blockChecksum) {
-				ctx.quit(LZ4MT_RESULT_BLOCK_CHECKSUM_MISMATCH);
-				return;
+		} else {
+			srcBits = ctx.readU32();
+			if(ctx.error()) {
+				ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_SIZE);
+				continue;
 			}
-		}
-		return;
-	};
 
-	bool eos = false;
-	for(int i = 0; !eos && !ctx.isQuit() && !ctx.readEof(); ++i) {
-		const auto srcBits = ctx.readU32();
-		if(ctx.error()) {
-			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_SIZE);
-			continue;
+			if(isEos(srcBits)) {
+				eos = true;
+				continue;
+			}
 		}
 
-		if(isEos(srcBits)) {
-			eos = true;
+		const auto srcSize = params.legacyFormat
+			? static_cast<int>(srcBits)
+			: getSrcSize(srcBits);
+		if(srcSize > srcBufferSize) {
+			ctx.quit(LZ4MT_RESULT_INVALID_BLOCK_SIZE);
 			continue;
 		}
 
-		const auto srcSize = getSrcSize(srcBits);
-		if(srcSize > params.nBlockMaximumSize) {
-			ctx.quit(LZ4MT_RESULT_INVALID_BLOCK_SIZE);
+		commitRing.waitSlot(nBlock);
+		session.acquire(blockBudget);
+		BufferPtr src(srcPools[nBlock].alloc());
+		if(! src) {
+			session.release(blockBudget);
+			ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
 			continue;
 		}
-
-		BufferPtr src(srcBufferPool.alloc());
 		const auto readSize = ctx.read(src->data(), srcSize);
 		if(srcSize != readSize || ctx.error()) {
+			session.release(blockBudget);
 			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_DATA);
 			continue;
 		}
@@ -711,45 +1630,211 @@ decompress(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
 
 		const auto blockCheckSum = params.blockCheckSumBytes ? ctx.readU32() : 0;
 		if(ctx.error()) {
+			session.release(blockBudget);
 			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_CHECKSUM);
 			continue;
 		}
 
-		const bool incompress = isIncompless(srcBits);
-		if(params.singleThread) {
-			f(0, src.release(), incompress, blockCheckSum);
-		} else {
-			futures.emplace_back(std::async(
-				  params.launch
-				, f, i, src.release(), incompress, blockCheckSum
-			));
-		}
+		const auto i = nBlock++;
+		auto* b = handoff[i];
+		*b = Block();
+		b->src = std::move(src);
+		b->budget = blockBudget;
+		b->xxhStream = xxhStream;
+
+		const bool incompress = !params.legacyFormat && isIncompless(srcBits);
+		// NOTE : 'params' is copied, since the frame may be over by then.
+		session.post(i, [=, &dstPools] {
+			decodeBlock(i, b, dstPools, params, incompress, blockCheckSum);
+		});
 	}
 
-	for(auto& e : futures) {
-		e.wait();
+	if(!ctx.error() && !ctx.isQuit() && params.streamChecksum) {
+		const auto srcStreamChecksum = ctx.readU32();
+		if(ctx.error()) {
+			ctx.quit(LZ4MT_RESULT_CANNOT_READ_STREAM_CHECKSUM);
+			return eos;
+		}
+
+		commitRing.waitSlot(nBlock);
+		const auto i = nBlock++;
+		auto* b = handoff[i];
+		*b = Block();
+		b->xxhStream = xxhStream;
+		b->frameEnd = true;
+		b->streamChecksum = srcStreamChecksum;
+
+		session.post(i, [this, b, i] {
+			commitRing.put(i, std::move(*b));
+		});
 	}
 
 	return eos;
 }
 
 
+// Block dependent (-BD) decoder as a pipeline :
+//
+//   read      : caller thread, reads a block into a src buffer.
+//   verify    : workers, block checksums in parallel.
+//   decode    : decodeRing's committer, strictly in order.
+//   write     : writeRing's committer, output and stream hash in order.
+//
+// decode hands a block over to write through a job, so decoding the next
+// block overlaps writing the previous one.  The caller waits for write's
+// window, which bounds every stage.
+//
+// History is never copied in the usual case : a block is decoded with
+// LZ4_decompress_safe_usingDict() against the preceding output where it
+// lies, and the output of an incompressible block is its src buffer.
+// Only when the preceding output is shorter than 64 KiB (lz4 and lz4mt
+// produce such a block only at the end), it's joined with the older
+// history into 'joined'.  Lz4MtStats::historyCopyBytes counts that.
 bool
-decompressBlockDependency(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStream)
+decompressBlockDependency(Ctx& ctx, const Params& params, Session& session, Lz4Mt::Xxh32& xxhStream)
 {
-	const size_t prefix64k = 64 * 1024;
+	const int prefix64k = 64 * 1024;
+
+	auto& threadPool = session.threadPool();
+	const uint64_t blockBudget = 2 * static_cast<uint64_t>(params.nBlockMaximumSize);
+	// NOTE : Two more buffers of each for 'history' and 'pending'.
+	Lz4Mt::MemPool srcBufferPool(params.nBlockMaximumSize, params.nPool + 2
+		, -1, ctx.poolCounters(), ctx.hugePages(), ctx.poolAllocator());
+	Lz4Mt::MemPool dstBufferPool(params.nBlockMaximumSize, params.nPool + 2
+		, -1, ctx.poolCounters(), ctx.hugePages(), ctx.poolAllocator());
+
+	struct Block {
+		Block() : src(), out(), incompressible(false), blockChecksum(0), outSize(0) {}
+		SharedBufferPtr src;
+		SharedBufferPtr out;	// src (incompressible) or dst buffer
+		bool incompressible;
+		uint32_t blockChecksum;
+		int outSize;
+	};
+
+	const auto write = [&session, &threadPool, &xxhStream, &params, &ctx, blockBudget] (Block& b) {
+		session.release(blockBudget);
+		if(ctx.error() || ctx.isQuit() || !b.out.get()) {
+			return;
+		}
+
+		const auto* outPtr = b.out->data();
+		const auto outSize = b.outSize;
+
+		std::future<void> futureStreamHash;
+		if(params.streamChecksum) {
+			futureStreamHash = threadPool.enqueueLeaf(
+				[&xxhStream, outPtr, outSize] {
+					xxhStream.update(outPtr, outSize);
+				}
+			);
+		}
+		if(! ctx.writeBin(outPtr, outSize)) {
+			ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK);
+		}
+		if(futureStreamHash.valid()) {
+			threadPool.wait(futureStreamHash);
+		}
+	};
+
+	Lz4Mt::CommitRing<Block> writeRing(params.nWindow, write);
+	HandoffSlots<Block> readHandoff(params.nWindow);
+	HandoffSlots<Block> decodeHandoff(params.nWindow);
+
+	SharedBufferPtr history;	// Owner of dictPtr, unless it's 'joined' or the preset dictionary
+	const char* dictPtr = params.dictionary ? params.dictionary->data() : nullptr;
+	int dictSize = params.dictionary ? params.dictionary->size() : 0;
+	SharedBufferPtr pending;	// Short output, not joined yet
+	int pendingSize = 0;
+	std::vector<char> joined;
+	std::vector<char> joinedNext;
+	uint64_t nDecoded = 0;
+
+	const auto updateHistory = [&] (SharedBufferPtr out, int outSize) {
+		if(outSize >= prefix64k || 0 == dictSize) {
+			history = std::move(out);
+			dictPtr = history->data();
+			dictSize = outSize;
+		} else {
+			pending = std::move(out);
+			pendingSize = outSize;
+		}
+	};
+
+	// Join a short output to the older history.  This is deferred until
+	// another block follows, so a short last block costs nothing.
+	const auto joinPending = [&] {
+		const auto keep = std::min(dictSize, prefix64k - pendingSize);
+		joinedNext.resize(keep + pendingSize);
+		memcpy(joinedNext.data(), dictPtr + dictSize - keep, keep);
+		memcpy(joinedNext.data() + keep, pending->data(), pendingSize);
+		ctx.countHistoryCopy(keep + pendingSize);
+		joined.swap(joinedNext);
+		history.reset();
+		pending.reset();
+		dictPtr = joined.data();
+		dictSize = static_cast<int>(joined.size());
+	};
 
-	const size_t nPool = 1;
-	Lz4Mt::MemPool srcBufferPool(params.nBlockMaximumSize, nPool);
-	Lz4Mt::MemPool dstBufferPool(prefix64k + params.nBlockMaximumSize, nPool);
+	const auto decode = [&] (Block& b) {
+		const auto i = nDecoded++;
+		if(! ctx.error() && ! ctx.isQuit()) {
+			if(pending.get()) {
+				joinPending();
+			}
+			const auto srcSize = static_cast<int>(b.src->size());
+			if(b.incompressible) {
+				b.out = b.src;
+				b.outSize = srcSize;
+			} else {
+				SharedBufferPtr dst(dstBufferPool.alloc());
+				if(nullptr == dst.get()) {
+					ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+				} else {
+					const auto decSize = LZ4_decompress_safe_usingDict(
+						  b.src->data(), dst->data(), srcSize, params.nBlockMaximumSize
+						, dictPtr, dictSize);
+					if(decSize < 0) {
+						ctx.quit(LZ4MT_RESULT_DECOMPRESS_FAIL);
+					} else {
+						b.out = std::move(dst);
+						b.outSize = decSize;
+					}
+				}
+			}
+			if(b.out.get()) {
+				updateHistory(b.out, b.outSize);
+			}
+		}
+		b.src.reset();
+
+		// NOTE : Hand over to a job, so the next block can be decoded
+		//        while this one is being written.
+		auto* raw = decodeHandoff[i];
+		*raw = std::move(b);
+		session.post(i, [&writeRing, raw, i] {
+			writeRing.put(i, std::move(*raw));
+		});
+	};
 
-	const BufferPtr src(srcBufferPool.alloc());
-	const BufferPtr dst(dstBufferPool.alloc());
+	// NOTE : writeRing may commit block i before decodeRing has finished
+	//        committing it, so decodeRing needs one more slot.
+	Lz4Mt::CommitRing<Block> decodeRing(params.nWindow + 1, decode);
 
-	auto* dstPtr = dst->data() + prefix64k;
+	const auto verify = [&decodeRing, &params, &ctx] (uint64_t i, Block* b) {
+		if(params.blockCheckSumBytes && ! ctx.error() && ! ctx.isQuit()) {
+			const auto hash = Lz4Mt::Xxh32::hash(
+				b->src->data(), static_cast<int>(b->src->size()), LZ4S_CHECKSUM_SEED);
+			if(hash != b->blockChecksum) {
+				ctx.quit(LZ4MT_RESULT_BLOCK_CHECKSUM_MISMATCH);
+			}
+		}
+		decodeRing.put(i, std::move(*b));
+	};
 
 	bool eos = false;
-	for(; !eos && !ctx.isQuit() && !ctx.readEof();) {
+	uint64_t nBlock = 0;
+	while(!eos && !ctx.isQuit() && !ctx.readEof()) {
 		const auto srcBits = ctx.readU32();
 		if(ctx.error()) {
 			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_SIZE);
@@ -761,86 +1846,52 @@ decompressBlockDependency(Ctx& ctx, const Params& params, Lz4Mt::Xxh32& xxhStrea
 			continue;
 		}
 
-		{
-			const auto srcSize = getSrcSize(srcBits);
-
-			if(srcSize > params.nBlockMaximumSize) {
-				ctx.quit(LZ4MT_RESULT_INVALID_BLOCK_SIZE);
-				continue;
-			}
+		const auto srcSize = getSrcSize(srcBits);
+		if(srcSize > params.nBlockMaximumSize) {
+			ctx.quit(LZ4MT_RESULT_INVALID_BLOCK_SIZE);
+			continue;
+		}
 
-			const auto readSize = ctx.read(src->data(), srcSize);
-			if(srcSize != readSize || ctx.error()) {
-				ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_DATA);
-				continue;
-			}
-			src->resize(srcSize);
+		writeRing.waitSlot(nBlock);
+		session.acquire(blockBudget);
+		BufferPtr src(srcBufferPool.alloc());
+		if(! src) {
+			session.release(blockBudget);
+			ctx.quit(LZ4MT_RESULT_CANNOT_ALLOCATE);
+			continue;
 		}
+		const auto readSize = ctx.read(src->data(), srcSize);
+		if(srcSize != readSize || ctx.error()) {
+			session.release(blockBudget);
+			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_DATA);
+			continue;
+		}
+		src->resize(readSize);
 
 		const auto blockCheckSum = params.blockCheckSumBytes ? ctx.readU32() : 0;
 		if(ctx.error()) {
+			session.release(blockBudget);
 			ctx.quit(LZ4MT_RESULT_CANNOT_READ_BLOCK_CHECKSUM);
 			continue;
 		}
 
-		if(params.blockCheckSumBytes) {
-			const auto hash = Lz4Mt::Xxh32(src->data(), static_cast<int>(src->size()), LZ4S_CHECKSUM_SEED).digest();
-			if(hash != blockCheckSum) {
-				ctx.quit(LZ4MT_RESULT_BLOCK_CHECKSUM_MISMATCH);
-				continue;
-			}
-		}
-
-		int decodedBytes = 0;
-
-		const bool incompress = isIncompless(srcBits);
-		if(incompress) {
-			if(! ctx.writeBin(src->data(), static_cast<int>(src->size()))) {
-				ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK);
-				continue;
-			}
-
-			if(params.streamChecksum) {
-				xxhStream.update(src->data(), static_cast<int>(src->size()));
-			}
-
-			if(src->size() >= prefix64k) {
-				memcpy(dst->data(), src->data() + src->size() - prefix64k, prefix64k);
-				dstPtr = dst->data() + prefix64k;
-				continue;
-			} else {
-				memcpy(dstPtr, src->data(), src->size());
-				decodedBytes = static_cast<int>(src->size());
-			}
-		} else {
-			decodedBytes = LZ4_decompress_safe_withPrefix64k(
-				src->data()
-				, dstPtr
-				, static_cast<int>(src->size())
-				, params.nBlockMaximumSize
-			);
-			if(decodedBytes < 0) {
-				ctx.quit(LZ4MT_RESULT_DECOMPRESS_FAIL);
-				continue;
-			}
-			
-			if(params.streamChecksum) {
-				xxhStream.update(dstPtr, decodedBytes);
-			}
-
-			if(! ctx.writeBin(dstPtr, decodedBytes)) {
-				ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK);
-				continue;
-			}
-		}
+		const auto i = nBlock++;
+		auto* b = readHandoff[i];
+		*b = Block();
+		b->src = std::move(src);
+		b->incompressible = isIncompless(srcBits);
+		b->blockChecksum = blockCheckSum;
 
-		dstPtr += decodedBytes;
-		if(dst->data() + dst->size() - dstPtr < params.nBlockMaximumSize) {
-			memcpy(dst->data(), dstPtr - prefix64k, prefix64k);
-			dstPtr = dst->data() + prefix64k;
-		}
+		session.post(i, [=] {
+			verify(i, b);
+		});
 	}
 
+	decodeRing.wait(nBlock);
+	writeRing.wait(nBlock);
+	history.reset();
+	pending.reset();
+
 	return eos;
 }
 
@@ -862,10 +1913,52 @@ lz4mtInitContext()
 	e.writeCtx			= nullptr;
 	e.write				= nullptr;
 	e.compress			= nullptr;
+	e.compressStateSize	= 0;
 	e.compressBound		= nullptr;
 	e.decompress		= nullptr;
 	e.mode				= LZ4MT_MODE_PARALLEL;
 	e.compressionLevel	= 0;
+	e.nThread			= 0;
+	e.engine			= nullptr;
+	e.engineWeight		= 0;
+	e.cpuList			= nullptr;
+	e.numaPlacement		= 0;
+	e.hugePages			= 0;
+	e.memoryBudget		= 0;
+	e.incompressibleProbe	= 0;
+	e.minSavings		= 0;
+	e.adaptiveLevel		= 0;
+	e.minCompressionLevel	= 0;
+	e.hcTimeLimit		= 0;
+	e.allocatorCtx		= nullptr;
+	e.allocate			= nullptr;
+	e.deallocate		= nullptr;
+	e.stats				= nullptr;
+	e.dictionary		= nullptr;
+	e.dictionaryCtx		= nullptr;
+	e.lookupDictionary	= nullptr;
+
+	return e;
+}
+
+
+extern "C" Lz4MtStats
+lz4mtInitStats()
+{
+	Lz4MtStats e = { 0 };
+
+	e.numaLocalBlocks	= 0;
+	e.numaRemoteBlocks	= 0;
+	e.historyCopyBytes	= 0;
+	e.bufferAllocs		= 0;
+	e.bufferFrees		= 0;
+	e.bufferWaits		= 0;
+	e.probedRawBlocks	= 0;
+	e.hcFallbackBlocks	= 0;
+	e.hcOverrunBlocks	= 0;
+	for(auto& n : e.levelBlocks) {
+		n = 0;
+	}
 
 	return e;
 }
@@ -901,25 +1994,38 @@ lz4mtCompress(Lz4MtContext* lz4MtContext, const Lz4MtStreamDescriptor* sd)
 	assert(lz4MtContext);
 	assert(sd);
 
-	const Params params(lz4MtContext, sd);
+	const bool legacyFormat = 0 != (lz4MtContext->mode & LZ4MT_MODE_LEGACY_FORMAT);
+	const auto params = legacyFormat ? Params(lz4MtContext) : Params(lz4MtContext, sd);
 	Ctx ctx(lz4MtContext);
 
-	makeHeader(ctx, sd);
-	if(LZ4MT_RESULT_OK != ctx.result()) {
-		return ctx.result();
+	if(! isValidCpuList(lz4MtContext)) {
+		return ctx.quit(LZ4MT_RESULT_BAD_ARG);
 	}
 
-	Lz4Mt::Xxh32 xxhStream(LZ4S_CHECKSUM_SEED);
+	if(!legacyFormat && sd->flg.presetDictionary && !params.dictionary) {
+		return ctx.quit(LZ4MT_RESULT_PRESET_DICTIONARY_NOT_FOUND);
+	}
 
-	if(sd->flg.blockIndependence) {
-		compress(ctx, params, xxhStream);
+	if(legacyFormat) {
+		if(!ctx.writeU32(LZ4S_LEGACY_MAGICNUMBER)) {
+			return ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_HEADER);
+		}
 	} else {
-		compressBlockDependency(ctx, params, xxhStream);
+		makeHeader(ctx, sd);
 	}
 	if(LZ4MT_RESULT_OK != ctx.result()) {
 		return ctx.result();
 	}
 
+	Lz4Mt::Xxh32 xxhStream(LZ4S_CHECKSUM_SEED);
+	if(! compressSmall(ctx, params, xxhStream)) {
+		Session session(lz4MtContext, params.nThread);
+		compress(ctx, params, session, xxhStream);
+	}
+	if(LZ4MT_RESULT_OK != ctx.result() || legacyFormat) {
+		return ctx.result();
+	}
+
 	if(!ctx.writeU32(LZ4S_EOS)) {
 		return ctx.quit(LZ4MT_RESULT_CANNOT_WRITE_EOS);
 	}
@@ -942,18 +2048,51 @@ lz4mtDecompress(Lz4MtContext* lz4MtContext, Lz4MtStreamDescriptor* sd)
 	assert(sd);
 
 	Ctx ctx(lz4MtContext);
+	if(! isValidCpuList(lz4MtContext)) {
+		return ctx.quit(LZ4MT_RESULT_BAD_ARG);
+	}
+
+	// NOTE : Workers and pools are set up at the first frame header, so
+	//        empty, skippable only and invalid inputs don't pay for them.
+	//        They're sized for that frame's blocks.  When a later frame
+	//        may have more blocks in flight (smaller blocks under a memory
+	//        budget), they're drained and set up again for it.
+	std::unique_ptr<Session> session;
+	std::unique_ptr<IndependentDecoder> decoder;
+	unsigned nSessionThread = 0;
+	const auto getDecoder = [&](const Params& params) -> IndependentDecoder& {
+		if(decoder && decoder->windowSize() < params.nWindow) {
+			decoder.reset();
+		}
+		if(! decoder) {
+			if(! session || nSessionThread < params.nThread) {
+				session.reset(new Session(lz4MtContext, params.nThread));
+				nSessionThread = params.nThread;
+			}
+			decoder.reset(new IndependentDecoder(ctx, *session, params.nWindow));
+		}
+		return *decoder;
+	};
 
 	bool magicNumberRecognized = false;
 
 	ctx.setResult(LZ4MT_RESULT_OK);
 	while(!ctx.isQuit() && !ctx.error() && !ctx.readEof()) {
-		const auto magic = ctx.readU32();
-		if(ctx.error()) {
-			if(ctx.readEof()) {
-				ctx.setResult(LZ4MT_RESULT_OK);
-			} else {
+		// NOTE : Blocks of the preceding frames may still be in flight, so
+		//        the end of input must not be reported as an error here.
+		uint32_t magic = 0;
+		const auto n = ctx.readU32(magic);
+		if(sizeof(magic) != n) {
+			if(0 != n && !ctx.readEof()) {
 				ctx.setResult(LZ4MT_RESULT_INVALID_HEADER);
 			}
+			break;
+		}
+
+		if(isLegacyMagicNumber(magic)) {
+			magicNumberRecognized = true;
+			const Params params(lz4MtContext);
+			getDecoder(params).decodeFrame(params);
 			continue;
 		}
 
@@ -969,12 +2108,12 @@ lz4mtDecompress(Lz4MtContext* lz4MtContext, Lz4MtStreamDescriptor* sd)
 					}
 				}
 			} else {
+				// NOTE : Trailing data after the last frame is left unread.
 				ctx.readSeek(-4);
 				if(magicNumberRecognized) {
-					ctx.setResult(LZ4MT_RESULT_OK);
-				} else {
-					ctx.setResult(LZ4MT_RESULT_INVALID_MAGIC_NUMBER);
+					break;
 				}
+				ctx.setResult(LZ4MT_RESULT_INVALID_MAGIC_NUMBER);
 			}
 			continue;
 		}
@@ -986,14 +2125,23 @@ lz4mtDecompress(Lz4MtContext* lz4MtContext, Lz4MtStreamDescriptor* sd)
 		}
 
 		const Params params(lz4MtContext, sd);
-		Lz4Mt::Xxh32 xxhStream(LZ4S_CHECKSUM_SEED);
+		if(sd->flg.presetDictionary && !params.dictionary) {
+			ctx.quit(LZ4MT_RESULT_PRESET_DICTIONARY_NOT_FOUND);
+			continue;
+		}
 
+		// NOTE : Blocks of independent frames are decoded in parallel across
+		//        frame boundaries.  A block dependent frame is decoded by its
+		//        own pipeline, after everything before it has been written.
 		if(params.blockIndependence) {
-			decompress(ctx, params, xxhStream);
-		} else {
-			decompressBlockDependency(ctx, params, xxhStream);
+			getDecoder(params).decodeFrame(params);
+			continue;
 		}
 
+		getDecoder(params).drain();
+		Lz4Mt::Xxh32 xxhStream(LZ4S_CHECKSUM_SEED);
+		decompressBlockDependency(ctx, params, *session, xxhStream);
+
 		if(!ctx.error() && params.streamChecksum) {
 			const auto srcStreamChecksum = ctx.readU32();
 			if(ctx.error()) {
@@ -1007,5 +2155,80 @@ lz4mtDecompress(Lz4MtContext* lz4MtContext, Lz4MtStreamDescriptor* sd)
 		}
 	}
 
+	if(decoder) {
+		decoder->drain();
+	}
 	return ctx.result();
 }
+
+
+extern "C" uint64_t
+lz4mtEstimateMemory(
+	  const Lz4MtContext* lz4MtContext
+	, const Lz4MtStreamDescriptor* sd
+	, int nThread
+) {
+	assert(lz4MtContext);
+	assert(sd);
+
+	auto c = *lz4MtContext;
+	if(nThread > 0) {
+		c.nThread = nThread;
+	}
+	const bool legacyFormat = 0 != (c.mode & LZ4MT_MODE_LEGACY_FORMAT);
+	const auto params = legacyFormat ? Params(&c) : Params(&c, sd);
+	const uint64_t blockSize = params.nBlockMaximumSize;
+	const uint64_t boundSize = static_cast<uint64_t>(LZ4_compressBound(params.nBlockMaximumSize));
+
+	// NOTE : The Session's node count depends on where its workers run.
+	//        Assume one node slot per NUMA node, up to one per worker.
+	const auto nodeCount = std::max<uint64_t>(c.numaPlacement
+		? std::min(Lz4Mt::getNumaNodeCount(), std::max(params.nThread, 1u)) : 1, 1);
+	// Elements of a NodePools of 'count' elements.
+	const auto nodePoolCount = [nodeCount](uint64_t count) {
+		return (count + nodeCount - 1) / nodeCount * nodeCount;
+	};
+
+	// Inputs smaller than one block (when 'sd' has the stream size) go
+	// through compressSmall() : one block sized src buffer, a dst buffer
+	// and a state.  Decoding them takes one src and one dst buffer.
+	const uint64_t streamSize = sd->flg.streamSize ? sd->streamSize : 0;
+	if(0 < streamSize && streamSize < blockSize) {
+		uint64_t smallBytes = blockSize;
+		if(! params.store) {
+			smallBytes += legacyFormat
+				? static_cast<uint64_t>(LZ4_compressBound(static_cast<int>(streamSize)))
+				: streamSize;
+			smallBytes += std::max<uint64_t>(c.compressStateSize
+				, BlockDependentCompressor::getStateSize(c.compressionLevel));
+		}
+		const uint64_t decBytes = (legacyFormat ? boundSize : blockSize) + blockSize;
+		return std::max(smallBytes, decBytes);
+	}
+
+	// compress() : src buffers of the blocks in flight (and of the
+	// preceding block of each node slot for -BD), their dst buffers, and
+	// one compression state per worker and the caller.
+	const bool keepPrev = !params.blockIndependence && !params.store;
+	uint64_t cmpBytes = nodePoolCount(params.nPool + (keepPrev ? nodeCount : 0)) * blockSize;
+	if(! params.store) {
+		const auto dstSize = legacyFormat ? boundSize : blockSize;
+		const auto stateSize = std::max<uint64_t>(c.compressStateSize
+			, BlockDependentCompressor::getStateSize(c.compressionLevel));
+		cmpBytes += nodePoolCount(params.nPool) * dstSize;
+		cmpBytes += (params.nThread + 1) * stateSize;
+	}
+
+	// lz4mtDecompress() : IndependentDecoder's src and dst buffers of the
+	// blocks in flight, or decompressBlockDependency()'s, two more of each
+	// for the history.
+	uint64_t decBytes = 0;
+	if(params.blockIndependence) {
+		decBytes = nodePoolCount(params.nWindow)
+			* ((legacyFormat ? boundSize : blockSize) + blockSize);
+	} else {
+		decBytes = (params.nPool + 2) * 2 * blockSize;
+	}
+
+	return std::max(cmpBytes, decBytes);
+}
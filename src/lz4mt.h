@@ -10,6 +10,10 @@ extern "C" {
 
 
 struct Lz4MtParam;
+struct Lz4MtEngine;
+typedef struct Lz4MtEngine Lz4MtEngine;
+struct Lz4MtDictionary;
+typedef struct Lz4MtDictionary Lz4MtDictionary;
 
 typedef int (*Lz4MtRead)(
 	  struct Lz4MtContext* ctx
@@ -38,8 +42,14 @@ typedef int (*Lz4MtWrite)(
 	, int srcSize
 );
 
+// 'state' : Scratch space of at least Lz4MtContext::compressStateSize bytes,
+//           owned by the calling worker while the call lasts.  It's reused
+//           for other blocks, so it must be initialized by each call.
+// 'compressionLevel' : Lz4MtContext::compressionLevel, or with adaptiveLevel
+//           any level from minCompressionLevel to it.
 typedef int (*Lz4MtCompress)(
-	  const char* src
+	  void* state
+	, const char* src
 	, char* dst
 	, int isize
 	, int maxOutputSize
@@ -50,6 +60,22 @@ typedef int (*Lz4MtCompressBound)(
 	  int isize
 );
 
+typedef const Lz4MtDictionary* (*Lz4MtLookupDictionary)(
+	  const struct Lz4MtContext* ctx
+	, uint32_t dictId
+);
+
+typedef void* (*Lz4MtAllocate)(
+	  const struct Lz4MtContext* ctx
+	, size_t size
+);
+
+typedef void (*Lz4MtDeallocate)(
+	  const struct Lz4MtContext* ctx
+	, void* ptr
+	, size_t size
+);
+
 typedef int (*Lz4MtDecompress)(
 	  const char* src
 	, char* dst
@@ -62,6 +88,8 @@ enum Lz4MtMode {
 	  LZ4MT_MODE_DEFAULT		= 0
 	, LZ4MT_MODE_PARALLEL		= 0 << 0
 	, LZ4MT_MODE_SEQUENTIAL		= 1 << 0
+	, LZ4MT_MODE_LEGACY_FORMAT	= 1 << 1	// lz4mtCompress() : legacy format, 'sd' is ignored
+	, LZ4MT_MODE_STORE			= 1 << 2	// lz4mtCompress() : store every block uncompressed, except legacy format
 };
 typedef enum Lz4MtMode Lz4MtMode;
 
@@ -95,6 +123,8 @@ enum Lz4MtResult {
 	, LZ4MT_RESULT_INVALID_HEADER_CANNOT_SKIP_SKIPPABLE_AREA
 	, LZ4MT_RESULT_CANNOT_WRITE_DATA_BLOCK
 	, LZ4MT_RESULT_CANNOT_WRITE_DECODED_BLOCK
+	, LZ4MT_RESULT_PRESET_DICTIONARY_NOT_FOUND
+	, LZ4MT_RESULT_CANNOT_ALLOCATE
 };
 typedef enum Lz4MtResult Lz4MtResult;
 
@@ -128,6 +158,26 @@ struct Lz4MtStreamDescriptor {
 typedef struct Lz4MtStreamDescriptor Lz4MtStreamDescriptor;
 
 
+enum {
+	  LZ4MT_STATS_LEVEL_MIN		= -14	// Lz4MtStats::levelBlocks[0] : this level and lower
+	, LZ4MT_STATS_LEVEL_COUNT	= 32	// The last entry : this level and higher
+};
+
+struct Lz4MtStats {
+	uint64_t	numaLocalBlocks;	// Blocks processed next to their buffers
+	uint64_t	numaRemoteBlocks;	// Blocks processed across NUMA nodes
+	uint64_t	historyCopyBytes;	// Bytes copied to keep -BD decoder's history
+	uint64_t	bufferAllocs;		// Buffers taken from the pools
+	uint64_t	bufferFrees;		// Buffers given back to the pools
+	uint64_t	bufferWaits;		// Allocations which had to wait for a free buffer
+	uint64_t	probedRawBlocks;	// Blocks stored uncompressed by incompressibleProbe
+	uint64_t	hcFallbackBlocks;	// HC blocks compressed fast since they'd overrun hcTimeLimit
+	uint64_t	hcOverrunBlocks;	// HC blocks which took longer than hcTimeLimit anyway
+	uint64_t	levelBlocks[LZ4MT_STATS_LEVEL_COUNT];	// Blocks compressed at level (LZ4MT_STATS_LEVEL_MIN + index)
+};
+typedef struct Lz4MtStats Lz4MtStats;
+
+
 struct Lz4MtContext {
 	Lz4MtResult			result;
 	void*				readCtx;
@@ -139,15 +189,48 @@ struct Lz4MtContext {
 	Lz4MtWrite			write;
 
 	Lz4MtCompress		compress;
+	size_t				compressStateSize;	// Bytes of compress()'s state
 	Lz4MtCompressBound	compressBound;
 	Lz4MtDecompress		decompress;
 	Lz4MtMode			mode;
-	int					compressionLevel;
+	int					compressionLevel;	// >= 3 : HC, < 0 : fast, acceleration -compressionLevel
+	int					nThread;			// 0 : hardware concurrency
+	Lz4MtEngine*		engine;				// nullptr : private worker set
+	int					engineWeight;		// 0 : 1
+	const char*			cpuList;			// "0-3,8" : pin workers, nullptr : no pinning
+	int					numaPlacement;		// 0 : off, 1 : per node buffers and queues
+	int					hugePages;			// 0 : off, 1 : huge page buffers when available
+											//     (buffers of at least one huge page)
+	uint64_t			memoryBudget;		// Bytes of buffers in flight, 0 : unlimited
+	int					incompressibleProbe;	// 0 : off, 1 : store blocks which look incompressible without compressing (blocks without -BD history or dictionary)
+	int					minSavings;			// Percent, blocks which save less are stored uncompressed
+	int					adaptiveLevel;		// 0 : off, 1 : each block's level follows the backpressure
+	int					minCompressionLevel;	// Lowest level of adaptiveLevel, which starts at compressionLevel
+	int					hcTimeLimit;		// Milliseconds of HC for one block of 1 MiB or more, 0 : unlimited
+	Lz4MtStats*			stats;				// nullptr : don't collect
+
+	// Preset dictionary.  When the frame has a dictId and lookupDictionary
+	// finds it, that one is used.  Otherwise 'dictionary' is used.
+	const Lz4MtDictionary*	dictionary;		// nullptr : none
+	void*					dictionaryCtx;
+	Lz4MtLookupDictionary	lookupDictionary;	// nullptr : no lookup
+
+	// Block buffers and LZ4 state are allocated through these when both are
+	// set.  They are called from worker threads.  'allocate' returns memory
+	// aligned like malloc(), or nullptr on failure, which ends the call with
+	// LZ4MT_RESULT_CANNOT_ALLOCATE.
+	// NOTE : Small bookkeeping still uses operator new : the thread pool's
+	//        job and future of each block, and per call or frame, pool
+	//        handles and the stream checksum state.
+	void*				allocatorCtx;
+	Lz4MtAllocate		allocate;			// nullptr : default allocator
+	Lz4MtDeallocate		deallocate;
 };
 typedef struct Lz4MtContext Lz4MtContext;
 
 
 Lz4MtContext lz4mtInitContext();
+Lz4MtStats lz4mtInitStats();
 Lz4MtStreamDescriptor lz4mtInitStreamDescriptor();
 const char* lz4mtResultToString(Lz4MtResult result);
 int lz4mtResultToLz4cExitCode(Lz4MtResult result);
@@ -162,6 +245,38 @@ Lz4MtResult lz4mtDecompress(
 	, Lz4MtStreamDescriptor* sd
 );
 
+// Expected peak of the buffers and codec states of lz4mtCompress() or
+// lz4mtDecompress() (the larger one) for 'sd', with the memory budget of
+// 'ctx' applied.  When sd->flg.streamSize is set, an input smaller than
+// one block is estimated as such.  Otherwise it's an upper bound : every
+// block in flight is assumed to be in use.
+uint64_t lz4mtEstimateMemory(
+	  const Lz4MtContext* ctx
+	, const Lz4MtStreamDescriptor* sd
+	, int nThread					// 0 : ctx->nThread
+);
+
+Lz4MtEngine* lz4mtCreateEngine(
+	  int nThread					// 0 : hardware concurrency
+	, uint64_t bufferBudget			// bytes, 0 : unlimited
+	, const char* cpuList			// nullptr : no pinning
+);
+
+void lz4mtDestroyEngine(
+	  Lz4MtEngine* engine
+);
+
+// Only the last 64 KiB of 'dict' are used.  They are copied, so 'dict'
+// may be freed afterwards.
+Lz4MtDictionary* lz4mtCreateDictionary(
+	  const void* dict
+	, size_t dictSize
+);
+
+void lz4mtDestroyDictionary(
+	  Lz4MtDictionary* dictionary
+);
+
 
 #if defined (__cplusplus)
 }
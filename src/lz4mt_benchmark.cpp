@@ -1,17 +1,27 @@
+#include <algorithm>
 #include <cassert>
 #include <cfloat>
 #include <chrono>
+#include <fstream>
 #include <future>
 #include <functional>
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <memory>
 #include <numeric>
 #include <string>
 #include <vector>
 #include "xxhash.h"
 #include "lz4mt.h"
 #include "lz4mt_benchmark.h"
+#include "lz4mt_compat.h"
+#include "lz4mt_mempool.h"
+#include "lz4mt_threadpool.h"
+#include "lz4mt_dictionary.h"
+
+#include "lz4.h"
+#include <string.h>
 
 namespace {
 
@@ -34,8 +44,164 @@ TimePoint getSyncTime() {
 
 double getTimeSpan(const TimePoint& tStart, const TimePoint& tEnd) {
 	using namespace std::chrono;
-	const auto dt = duration_cast<seconds>(tEnd - tStart).count();
-	return static_cast<double>(dt);
+	return duration_cast<duration<double>>(tEnd - tStart).count();
+}
+
+unsigned getThreadCount(const Lz4MtContext* ctx) {
+	if(0 != (ctx->mode & LZ4MT_MODE_SEQUENTIAL)) {
+		return 1;
+	} else if(ctx->nThread > 0) {
+		return static_cast<unsigned>(ctx->nThread);
+	} else {
+		return Lz4Mt::getHardwareConcurrency();
+	}
+}
+
+std::vector<unsigned> getCpuList(const Lz4MtContext* ctx) {
+	std::vector<unsigned> cpus;
+	if(ctx->cpuList) {
+		Lz4Mt::parseCpuList(ctx->cpuList, cpus);
+	}
+	return cpus;
+}
+
+
+const size_t TRAIN_DICTIONARY_SIZE	= 64 * 1024;
+const size_t TRAIN_SEGMENT_SIZE		= 1024;		// k
+const size_t TRAIN_DMER_SIZE		= 8;		// d
+const int TRAIN_HASH_LOG			= 20;
+const size_t TRAIN_HOLD_OUT			= 5;		// Every 5th sample is held out
+
+size_t hashDmer(const char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return static_cast<size_t>((v * 0x9E3779B185EBCA87ULL) >> (64 - TRAIN_HASH_LOG));
+}
+
+template<typename F>
+void runJobs(Lz4Mt::ThreadPool& threadPool, size_t nJob, F f) {
+	std::vector<std::future<void>> futures;
+	for(size_t j = 0; j < nJob; ++j) {
+		futures.push_back(threadPool.enqueue([&f, j] { f(j); }));
+	}
+	for(auto& e : futures) {
+		threadPool.wait(e);
+	}
+}
+
+
+// Simplified COVER :
+//
+// Count every d byte string ("dmer") of 'data'.  Then 'data' is split into
+// one epoch for each k byte segment of the dictionary, and from each epoch
+// the segment whose distinct dmers have the highest total count is picked.
+// Dmers of a picked segment are forgotten, so later epochs look for
+// something else.  Picked segments are sorted by score, and the best ones
+// go to the end of the dictionary, nearest to the data.
+//
+// Counting is split across the workers.  Epochs are searched in rounds of
+// one epoch per worker, so the epochs of a round don't see each other's
+// picks.
+std::vector<char> buildDictionary(Lz4Mt::ThreadPool& threadPool, const std::vector<char>& data) {
+	if(data.size() <= TRAIN_DICTIONARY_SIZE) {
+		return data;
+	}
+
+	const size_t nHash = size_t(1) << TRAIN_HASH_LOG;
+	const size_t nDmer = data.size() - TRAIN_DMER_SIZE + 1;
+	const size_t nJob = std::max<size_t>(threadPool.size(), 1);
+
+	std::vector<std::vector<uint32_t>> counts(nJob);
+	runJobs(threadPool, nJob, [&](size_t j) {
+		auto& c = counts[j];
+		c.assign(nHash, 0);
+		for(auto i = nDmer * j / nJob, e = nDmer * (j + 1) / nJob; i < e; ++i) {
+			++c[hashDmer(&data[i])];
+		}
+	});
+	auto& freqs = counts[0];
+	for(size_t j = 1; j < nJob; ++j) {
+		for(size_t h = 0; h < nHash; ++h) {
+			freqs[h] += counts[j][h];
+		}
+		std::vector<uint32_t>().swap(counts[j]);
+	}
+
+	struct Segment {
+		size_t begin;
+		size_t end;
+		uint64_t score;
+	};
+
+	const size_t nEpoch = TRAIN_DICTIONARY_SIZE / TRAIN_SEGMENT_SIZE;
+	const size_t epochSize = data.size() / nEpoch;
+	const size_t nWindow = TRAIN_SEGMENT_SIZE - TRAIN_DMER_SIZE + 1;
+
+	// 'active' counts the dmers in the sliding window, and is left zeroed.
+	const auto findBest = [&](size_t epoch, std::vector<uint16_t>& active) {
+		const auto eBegin = epoch * epochSize;
+		const auto eEnd = std::min(eBegin + epochSize, nDmer);
+		Segment best = { eBegin, eBegin, 0 };
+		uint64_t score = 0;
+		auto b = eBegin;
+		for(auto e = eBegin; e < eEnd; ++e) {
+			const auto h = hashDmer(&data[e]);
+			if(0 == active[h]++) {
+				score += freqs[h];
+			}
+			if(e + 1 - b > nWindow) {
+				const auto hb = hashDmer(&data[b++]);
+				if(0 == --active[hb]) {
+					score -= freqs[hb];
+				}
+			}
+			if(score > best.score) {
+				best.begin = b;
+				best.end = e + TRAIN_DMER_SIZE;
+				best.score = score;
+			}
+		}
+		for(; b < eEnd; ++b) {
+			--active[hashDmer(&data[b])];
+		}
+		return best;
+	};
+
+	std::vector<std::vector<uint16_t>> actives(nJob);
+	std::vector<Segment> picked;
+	auto tail = TRAIN_DICTIONARY_SIZE;
+	for(size_t epoch = 0; epoch < nEpoch && tail > 0; epoch += nJob) {
+		const auto n = std::min(nJob, nEpoch - epoch);
+		std::vector<Segment> segments(n);
+		runJobs(threadPool, n, [&](size_t j) {
+			auto& active = actives[j];
+			active.resize(nHash);
+			segments[j] = findBest(epoch + j, active);
+		});
+
+		for(const auto& seg : segments) {
+			if(0 == seg.score || 0 == tail) {
+				continue;
+			}
+			for(auto i = seg.begin; i + TRAIN_DMER_SIZE <= seg.end; ++i) {
+				freqs[hashDmer(&data[i])] = 0;
+			}
+			const auto size = std::min(seg.end - seg.begin, tail);
+			tail -= size;
+			const Segment e = { seg.end - size, seg.end, seg.score };
+			picked.push_back(e);
+		}
+	}
+
+	std::stable_sort(picked.begin(), picked.end(), [](const Segment& a, const Segment& b) {
+		return a.score < b.score;
+	});
+	std::vector<char> dict;
+	dict.reserve(TRAIN_DICTIONARY_SIZE - tail);
+	for(const auto& seg : picked) {
+		dict.insert(dict.end(), data.begin() + seg.begin, data.begin() + seg.end);
+	}
+	return dict;
 }
 
 } // anonymous namespace
@@ -45,8 +211,13 @@ namespace Lz4Mt {
 
 Benchmark::Benchmark()
 	: enable(false)
+	, training(false)
+	, dictFilename()
 	, pause(false)
 	, nIter(3)
+	, levelSweep(false)
+	, firstLevel(0)
+	, lastLevel(0)
 	, files()
 	, openIstream()
 	, closeIstream()
@@ -56,32 +227,63 @@ Benchmark::Benchmark()
 Benchmark::~Benchmark()
 {}
 
-int Benchmark::measure(
-	  Lz4MtContext& cx
-	, const Lz4MtStreamDescriptor& sd
+int Benchmark::load(
+	  Lz4MtContext* ctx
+	, const std::string& filename
+	, std::vector<char>& buf
 ) {
 	auto& logger = std::cerr;
 
-	const auto msgClearLine = [&logger] {
-		logger << "\r" << std::setw(79) << " " << "\r";
-	};
-
-	const auto msgNewline = [&logger] {
-		logger << std::endl;
-	};
-
-	const auto msgErrOpening = [&logger](const std::string& filename) {
+	buf.resize(static_cast<size_t>(getFilesize(filename)));
+	if(!openIstream(ctx, filename)) {
 		logger << "Error: problem opening " << filename << std::endl;
-	};
+		return 11;
+	}
 
-	const auto msgLoading = [&logger](const std::string& filename) {
-		logger << "Loading " << filename << "...\r";
-		logger.flush();
-	};
+	logger << "Loading " << filename << "...\r";
+	logger.flush();
+	const size_t readSize = ctx->read(ctx, buf.data()
+							  , static_cast<int>(buf.size()));
+	closeIstream(ctx);
 
-	const auto msgErrReading = [&logger](const std::string& filename) {
+	if(buf.size() != readSize) {
 		logger << std::endl
 			 << "Error: problem reading file " << filename << std::endl;
+		return 13;
+	}
+
+	logger << "\r" << std::setw(79) << " " << "\r";
+	return 0;
+}
+
+int Benchmark::measure(
+	  Lz4MtContext& cx
+	, const Lz4MtStreamDescriptor& sd
+) {
+	if(! levelSweep) {
+		return measureLevel(cx, sd);
+	}
+
+	const auto level = cx.compressionLevel;
+	int r = 0;
+	for(int l = firstLevel; 0 == r && l <= lastLevel; ++l) {
+		std::cerr << "Level " << l << " :" << std::endl;
+		cx.compressionLevel = l;
+		r = measureLevel(cx, sd);
+	}
+	cx.compressionLevel = level;
+	return r;
+}
+
+
+int Benchmark::measureLevel(
+	  Lz4MtContext& cx
+	, const Lz4MtStreamDescriptor& sd
+) {
+	auto& logger = std::cerr;
+
+	const auto msgNewline = [&logger] {
+		logger << std::endl;
 	};
 
 	const auto msgErrChecksum = [&logger]
@@ -137,6 +339,23 @@ int Benchmark::measure(
 
 	auto* ctx = &cx;
 	const bool singleThread = 0 != (ctx->mode & LZ4MT_MODE_SEQUENTIAL);
+	ThreadPool threadPool(getThreadCount(ctx), getCpuList(ctx));
+
+	// Same placement as lz4mtCompress() : chunk i belongs to node slot
+	// (i % queues.size()), and its buffers are bound to that node.
+	std::vector<int> nodes;
+	if(ctx->numaPlacement && threadPool.nodes().size() > 1) {
+		nodes = threadPool.nodes();
+	} else {
+		nodes.push_back(-1);
+	}
+	std::vector<std::unique_ptr<ThreadPool::Queue>> queues;
+	for(const auto node : nodes) {
+		queues.emplace_back(new ThreadPool::Queue(threadPool, 1, node));
+	}
+	// One compression state per worker, and one for the caller.
+	MemPool statePool(std::max<size_t>(ctx->compressStateSize, 1), threadPool.size() + 1);
+
 	size_t totalFileSize = 0;
 	size_t totalCompressSize = 0;
 	double totalCompressTime = 0.0;
@@ -144,30 +363,13 @@ int Benchmark::measure(
 	const auto TIMELOOP = 2.0;	// sec
 
 	for(const auto& filename : files) {
-		std::vector<char> inpBuf(
-			static_cast<size_t>(getFilesize(filename))
-		);
-
-		{
-			if(!openIstream(ctx, filename)) {
-				msgErrOpening(filename);
-				return 11;
-			}
-
-			msgLoading(filename);
-			const size_t readSize = ctx->read(ctx, inpBuf.data()
-									  , static_cast<int>(inpBuf.size()));
-			closeIstream(ctx);
-
-			if(inpBuf.size() != readSize) {
-				msgErrReading(filename);
-				return 13;
-			}
+		std::vector<char> inpBuf;
+		if(const auto r = load(ctx, filename, inpBuf)) {
+			return r;
 		}
-		msgClearLine();
 
 		const auto inpHash =
-			XXH32(inpBuf.data(), static_cast<int>(inpBuf.size()), 0);
+			XXH32(inpBuf.data(), inpBuf.size(), 0);
 		const auto chunkSize =
 				(size_t(1) << (8 + (2 * sd.bd.blockMaximumSize)));
 		const auto nChunk		= (inpBuf.size() / chunkSize) + 1;
@@ -200,12 +402,18 @@ int Benchmark::measure(
 				e.cmpSize	= 0;
 				e.decSize	= 0;
 				r -= e.inpSize;
+
+				const auto node = nodes[i % nodes.size()];
+				if(node >= 0) {
+					bindToNumaNode(e.inpPtr, e.inpSize, node);
+					bindToNumaNode(e.outPtr, e.outSize, node);
+				}
 			}
 		}
 
 		std::vector<std::future<void>> futures(chunks.size());
 
-		const auto b = [=, &futures, &chunks]
+		const auto b = [=, &futures, &chunks, &queues]
 			(std::function<void(Chunk*)> fChunk) -> double
 		{
 			const auto t0 = getSyncTime();
@@ -214,7 +422,14 @@ int Benchmark::measure(
 
 			while(getTimeSpan(t0, t1 = getTime()) < TIMELOOP) {
 				for(auto& e : chunks) {
-					futures[e.id] = async(std::launch::async, fChunk, &e);
+					auto* cp = &e;
+					const auto task = std::make_shared<std::packaged_task<void()>>(
+						[fChunk, cp] {
+							fChunk(cp);
+						}
+					);
+					futures[e.id] = task->get_future();
+					queues[e.id % queues.size()]->post([task] { (*task)(); });
 				}
 				for(auto& e : futures) {
 					e.wait();
@@ -235,12 +450,14 @@ int Benchmark::measure(
 			// compression
 			iota(outBuf.begin(), outBuf.end(), 0);
 			const auto cmpTime = b(
-				[ctx, singleThread, &futures] (Chunk* cp) {
+				[ctx, singleThread, &futures, &statePool] (Chunk* cp) {
 					if(singleThread && cp->id > 0) {
 						futures[cp->id-1].wait();
 					}
+					MemPool::BufferPtr state(statePool.alloc());
 					cp->cmpSize = ctx->compress(
-						  cp->inpPtr
+						  state->data()
+						, cp->inpPtr
 						, cp->outPtr
 						, static_cast<int>(cp->inpSize)
 						, static_cast<int>(cp->outSize)
@@ -281,7 +498,7 @@ int Benchmark::measure(
 					  , cmpSize, minCmpTime, minDecTime);
 
 			const auto outHash =
-				XXH32(inpBuf.data(), static_cast<int>(inpBuf.size()), 0);
+				XXH32(inpBuf.data(), inpBuf.size(), 0);
 
 			if(inpHash != outHash) {
 				msgErrChecksum(filename, inpHash, outHash);
@@ -305,4 +522,190 @@ int Benchmark::measure(
 	return 0;
 }
 
+
+int Benchmark::train(
+	  Lz4MtContext& cx
+	, const Lz4MtStreamDescriptor& sd
+) {
+	auto& logger = std::cerr;
+	auto* ctx = &cx;
+	ThreadPool threadPool(getThreadCount(ctx), getCpuList(ctx));
+	const auto TIMELOOP = 2.0;	// sec
+
+	struct Sample {
+		const char*	ptr;
+		int			size;
+	};
+
+	// Samples are the blocks of each file, as lz4mtCompress() sees them.
+	const auto blockSize = size_t(1) << (8 + (2 * sd.bd.blockMaximumSize));
+	std::vector<std::vector<char>> bufs(files.size());
+	std::vector<Sample> trainSamples;
+	std::vector<Sample> testSamples;
+	size_t nSample = 0;
+	for(size_t i = 0; i < files.size(); ++i) {
+		if(const auto r = load(ctx, files[i], bufs[i])) {
+			return r;
+		}
+		const auto& buf = bufs[i];
+		for(size_t pos = 0; pos < buf.size(); pos += blockSize) {
+			const Sample e = {
+				&buf[pos], static_cast<int>(std::min(blockSize, buf.size() - pos))
+			};
+			(0 == (++nSample % TRAIN_HOLD_OUT) ? testSamples : trainSamples).push_back(e);
+		}
+	}
+
+	std::vector<char> trainData;
+	for(const auto& e : trainSamples) {
+		trainData.insert(trainData.end(), e.ptr, e.ptr + e.size);
+	}
+
+	const auto t0 = getTime();
+	const auto dict = buildDictionary(threadPool, trainData);
+	const auto trainTime = getTimeSpan(t0, getTime());
+	const auto dictId = sd.flg.presetDictionary
+		? sd.dictId
+		: XXH32(dict.data(), dict.size(), 0);
+
+	{
+		std::ofstream ofs(dictFilename, std::ios::binary);
+		if(!ofs.write(dict.data(), dict.size())) {
+			logger << "Error: problem writing " << dictFilename << std::endl;
+			return 14;
+		}
+	}
+
+	logger.precision(2);
+	logger << std::fixed
+		<< "Dictionary     : " << dictFilename << ", " << dict.size() << " bytes"
+		<< ", dictId " << dictId
+		<< " (" << trainSamples.size() << " samples, " << trainData.size() << " bytes"
+		<< ", " << trainTime << " s)" << std::endl;
+
+	// Compress the held out samples, each as an independent block, with and
+	// without the dictionary.  Samples are split into one group per job.
+	const auto& samples = testSamples.empty() ? trainSamples : testSamples;
+	if(samples.empty()) {
+		return 0;
+	}
+	const auto nGroup = std::min<size_t>(samples.size(), std::max(threadPool.size(), 1U) * 4);
+	std::vector<size_t> outPos(samples.size() + 1, 0);
+	size_t totalSize = 0;
+	for(size_t i = 0; i < samples.size(); ++i) {
+		outPos[i+1] = outPos[i] + ctx->compressBound(samples[i].size);
+		totalSize += samples[i].size;
+	}
+	std::vector<char> outBuf(outPos.back());
+	std::vector<char> decBuf(blockSize * samples.size());
+	std::vector<int> cmpSizes(samples.size());
+
+	struct Result {
+		size_t	cmpSize;
+		double	cmpTime;
+		double	decTime;
+		bool	valid;
+	};
+
+	const auto forEachGroup = [&](std::function<void(size_t, size_t)> f) -> double {
+		auto minTime = DBL_MAX;
+		for(int iLoop = 0; iLoop < nIter; ++iLoop) {
+			const auto t0 = getSyncTime();
+			auto t1 = t0;
+			int loopCount = 0;
+			while(getTimeSpan(t0, t1 = getTime()) < TIMELOOP) {
+				runJobs(threadPool, nGroup, [&](size_t g) {
+					for(auto i = samples.size() * g / nGroup
+						, e = samples.size() * (g + 1) / nGroup; i < e; ++i
+					) {
+						f(g, i);
+					}
+				});
+				++loopCount;
+			}
+			minTime = std::min(minTime, getTimeSpan(t0, t1) / static_cast<double>(loopCount));
+		}
+		return minTime;
+	};
+
+	const auto evaluate = [&](const Lz4MtDictionary* d) -> Result {
+		const auto level = ctx->compressionLevel;
+		// One compression state per group.
+		MemPool statePool(std::max(
+			  Lz4MtDictionary::getStateSize(level), ctx->compressStateSize), nGroup);
+		std::vector<MemPool::BufferPtr> states;
+		for(size_t g = 0; g < nGroup; ++g) {
+			states.push_back(statePool.alloc());
+		}
+		Result r = { 0, 0.0, 0.0, true };
+
+		r.cmpTime = forEachGroup([&](size_t g, size_t i) {
+			const auto& e = samples[i];
+			auto* out = &outBuf[outPos[i]];
+			const auto outSize = static_cast<int>(outPos[i+1] - outPos[i]);
+			if(d) {
+				cmpSizes[i] = d->compress(states[g]->data(), e.ptr, out, e.size, outSize, level);
+			} else {
+				cmpSizes[i] = ctx->compress(states[g]->data(), e.ptr, out, e.size, outSize, level);
+			}
+		});
+
+		r.decTime = forEachGroup([&](size_t, size_t i) {
+			const auto* in = &outBuf[outPos[i]];
+			auto* dec = &decBuf[i * blockSize];
+			const auto maxSize = static_cast<int>(blockSize);
+			if(d) {
+				LZ4_decompress_safe_usingDict(in, dec, cmpSizes[i], maxSize, d->data(), d->size());
+			} else {
+				ctx->decompress(in, dec, cmpSizes[i], maxSize);
+			}
+		});
+
+		for(size_t i = 0; i < samples.size(); ++i) {
+			r.cmpSize += cmpSizes[i];
+			r.valid = r.valid && 0 == memcmp(samples[i].ptr, &decBuf[i * blockSize], samples[i].size);
+		}
+		return r;
+	};
+
+	const auto msgReport = [&](const std::string& name, const Result& r) {
+		const auto dTotalMib = static_cast<double>(totalSize) / 1024.0 / 1024.0;
+		logger
+			<< std::setw(14) << std::left << name << " :"
+			<< std::setw(10) << std::right << totalSize << " ->"
+			<< std::setw(10) << r.cmpSize;
+		logger.precision(2);
+		logger
+			<< " ("
+			<< std::setw(6) << static_cast<double>(r.cmpSize) * 100.0 / static_cast<double>(totalSize)
+			<< "%),";
+		logger.precision(1);
+		logger
+			<< std::setw(7) << dTotalMib / r.cmpTime << " MiB/s, "
+			<< std::setw(7) << dTotalMib / r.decTime << " MiB/s"
+			<< (r.valid ? "" : "  !!! WARNING !!! Invalid result")
+			<< std::endl;
+	};
+
+	logger << (testSamples.empty() ? "Training set" : "Held out") << "       : "
+		<< samples.size() << " samples" << std::endl;
+
+	std::unique_ptr<Lz4MtDictionary, void(*)(Lz4MtDictionary*)> dictionary(
+		lz4mtCreateDictionary(dict.data(), dict.size()), lz4mtDestroyDictionary);
+	const auto plain = evaluate(nullptr);
+	msgReport("No dictionary", plain);
+	const auto withDict = evaluate(dictionary.get());
+	msgReport("Dictionary", withDict);
+
+	logger.precision(2);
+	logger
+		<< "Improvement    : ratio x"
+		<< static_cast<double>(plain.cmpSize) / static_cast<double>(std::max<size_t>(withDict.cmpSize, 1))
+		<< ", compression x" << plain.cmpTime / withDict.cmpTime
+		<< ", decompression x" << plain.decTime / withDict.decTime
+		<< std::endl;
+
+	return (plain.valid && withDict.valid) ? 0 : 1;
+}
+
 } // namespace Lz4Mt
@@ -12,15 +12,31 @@ class Benchmark {
 public:
 	Benchmark();
 	~Benchmark();
+	// Measure ctx.compressionLevel, or every level from firstLevel to
+	// lastLevel when levelSweep is set.
 	int measure(Lz4MtContext& ctx, const Lz4MtStreamDescriptor& sd);
 
+	// Build a dictionary from the blocks of 'files' and write it to
+	// 'dictFilename'.  Every 5th block is held out, and compressed with and
+	// without the dictionary to show whether it pays off.
+	int train(Lz4MtContext& ctx, const Lz4MtStreamDescriptor& sd);
+
 	bool						enable;
+	bool						training;
+	std::string					dictFilename;
 	bool						pause;
 	int							nIter;
+	bool						levelSweep;
+	int							firstLevel;
+	int							lastLevel;
 	std::vector<std::string>	files;
 	std::function<bool (Lz4MtContext* ctx, const std::string& filename)> openIstream;
 	std::function<void (Lz4MtContext* ctx)> closeIstream;
 	std::function<uint64_t (const std::string& filename)> getFilesize;
+
+private:
+	int measureLevel(Lz4MtContext& ctx, const Lz4MtStreamDescriptor& sd);
+	int load(Lz4MtContext* ctx, const std::string& filename, std::vector<char>& buf);
 };
 
 }
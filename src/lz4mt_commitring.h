@@ -0,0 +1,127 @@
+#ifndef LZ4MT_COMMITRING_H
+#define LZ4MT_COMMITRING_H
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+
+namespace Lz4Mt {
+
+// Sequence numbered reorder ring.
+//
+// Workers put() finished blocks in any order and return immediately.
+// Blocks are passed to the commit function strictly in sequence order.
+// Whoever completes the next expected sequence becomes the (only) committer
+// and drains every consecutive ready slot; other put()s don't wait.
+//
+// The ring is also the in-flight window : no more than nSlot blocks may be
+// in flight, i.e. put(seq + nSlot) never happens before seq was committed.
+// The producer calls waitSlot(seq) before it starts block 'seq', which
+// stalls it while the window is full.
+template<typename T>
+class CommitRing {
+public:
+	typedef std::function<void(T&)> CommitFunc;
+
+	CommitRing(size_t nSlot, CommitFunc commitFunc)
+		: nSlot(nSlot)
+		, slots(new Slot[nSlot])
+		, commitFunc(commitFunc)
+		, next(0)
+		, committing(false)
+		, nPutting(0)
+		, mut()
+		, cond()
+	{}
+
+	void put(uint64_t seq, T&& value) {
+		assert(seq < committed() + nSlot);
+		++nPutting;
+		auto& s = slots[seq % nSlot];
+		s.value = std::move(value);
+		s.seq.store(seq + 1);
+		drain();
+
+		std::unique_lock<std::mutex> lock(mut);
+		--nPutting;
+		cond.notify_all();
+	}
+
+	// Number of committed blocks.
+	uint64_t committed() const {
+		return next.load(std::memory_order_acquire);
+	}
+
+	// Wait until block 'seq' fits in the window.
+	void waitSlot(uint64_t seq) {
+		if(seq < committed() + nSlot) {
+			return;
+		}
+		std::unique_lock<std::mutex> lock(mut);
+		while(seq >= committed() + nSlot) {
+			cond.wait(lock);
+		}
+	}
+
+	// Wait until 'count' blocks have been committed and every put() returned.
+	void wait(uint64_t count) {
+		std::unique_lock<std::mutex> lock(mut);
+		while(committed() < count || 0 != nPutting) {
+			cond.wait(lock);
+		}
+	}
+
+private:
+	CommitRing(const CommitRing&);
+	const CommitRing& operator=(const CommitRing&);
+
+	struct Slot {
+		Slot() : seq(0), value() {}
+		std::atomic<uint64_t> seq;		// 0 : empty, otherwise sequence + 1
+		T value;
+	};
+
+	bool isNextReady() const {
+		const auto n = next.load();
+		return n + 1 == slots[n % nSlot].seq.load();
+	}
+
+	void drain() {
+		while(! committing.exchange(true)) {
+			while(isNextReady()) {
+				const auto n = next.load(std::memory_order_relaxed);
+				auto& s = slots[n % nSlot];
+				{
+					T value(std::move(s.value));
+					s.seq.store(0);
+					commitFunc(value);
+				}
+				next.store(n + 1, std::memory_order_release);
+			}
+			committing.store(false);
+
+			// NOTE : Another put() may have arrived after our last check
+			//        but before we released 'committing'.
+			if(! isNextReady()) {
+				break;
+			}
+		}
+	}
+
+	const size_t nSlot;
+	const std::unique_ptr<Slot[]> slots;
+	const CommitFunc commitFunc;
+	std::atomic<uint64_t> next;
+	std::atomic<bool> committing;
+	std::atomic<int> nPutting;
+	std::mutex mut;
+	std::condition_variable cond;
+};
+
+} // namespace Lz4Mt
+
+#endif // LZ4MT_COMMITRING_H
@@ -1,5 +1,13 @@
 #include <cassert>
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
 #include <future>
+#include <new>
+#include <sstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
 
 #if defined(__GLIBC__)
 #include <sys/sysinfo.h> // get_nprocs()
@@ -9,6 +17,21 @@
 #include <sys/types.h>
 #include <sys/sysctl.h>
 #endif
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
 #include "lz4mt_compat.h"
 
 
@@ -30,13 +53,201 @@ const decltype(Lz4Mt::launch::deferred) Lz4Mt::launch::deferred = LAUNCH_SINGLE_
 const decltype(Lz4Mt::launch::async)    Lz4Mt::launch::async    = std::launch::async;
 
 
+namespace {
+
+#if defined(__linux__)
+// Controller -> path, from /proc/self/cgroup.  cgroup v2 uses "".
+std::vector<std::pair<std::string, std::string>> getCgroupPaths() {
+	std::vector<std::pair<std::string, std::string>> paths;
+	std::ifstream ifs("/proc/self/cgroup");
+	std::string line;
+	while(std::getline(ifs, line)) {
+		// "hierarchy-ID:controller-list:cgroup-path"
+		const auto c0 = line.find(':');
+		const auto c1 = std::string::npos == c0 ? c0 : line.find(':', c0 + 1);
+		if(std::string::npos == c1) {
+			continue;
+		}
+		const auto path = line.substr(c1 + 1);
+		std::istringstream controllers(line.substr(c0 + 1, c1 - c0 - 1));
+		std::string controller;
+		if(c1 == c0 + 1) {
+			paths.emplace_back(std::string(), path);
+		}
+		while(std::getline(controllers, controller, ',')) {
+			paths.emplace_back(controller, path);
+		}
+	}
+	return paths;
+}
+
+
+// Visit the directory of our cgroup for 'controller' and each of its
+// ancestors; the effective limit is the smallest one found.  The cgroup may
+// also be mounted as its own root (container namespaces), therefore the
+// mount root is always visited.
+template<typename F>
+void forEachCgroupDir(const std::string& controller, F f) {
+	const std::string root = "/sys/fs/cgroup";
+	for(const auto& e : getCgroupPaths()) {
+		if(e.first != controller) {
+			continue;
+		}
+		const auto mount = controller.empty() ? root : root + "/" + controller;
+		auto path = e.second;
+		for(;;) {
+			f(mount + path + "/");
+			if(path.empty() || "/" == path) {
+				break;
+			}
+			const auto pos = path.rfind('/');
+			path = std::string::npos == pos ? std::string() : path.substr(0, pos);
+		}
+	}
+}
+
+
+// First word of a cgroup file.  Empty when it can't be read.
+std::string readCgroupValue(const std::string& filename) {
+	std::ifstream ifs(filename);
+	std::string s;
+	ifs >> s;
+	return s;
+}
+
+
+// Cgroup CPU quota, rounded up.  0 : unlimited.
+unsigned getCgroupCpuLimit() {
+	double limit = 0.0;
+	const auto update = [&limit](const std::string& quota, const std::string& period) {
+		const auto q = atof(quota.c_str());
+		const auto p = atof(period.c_str());
+		if(q > 0.0 && p > 0.0 && (0.0 == limit || q / p < limit)) {
+			limit = q / p;
+		}
+	};
+
+	// v2 : "max 100000" or "400000 100000"
+	forEachCgroupDir("", [&](const std::string& dir) {
+		std::ifstream ifs(dir + "cpu.max");
+		std::string quota;
+		std::string period;
+		if((ifs >> quota >> period) && "max" != quota) {
+			update(quota, period);
+		}
+	});
+
+	// v1 : cpu.cfs_quota_us is -1 when unlimited
+	forEachCgroupDir("cpu", [&](const std::string& dir) {
+		update(readCgroupValue(dir + "cpu.cfs_quota_us")
+			 , readCgroupValue(dir + "cpu.cfs_period_us"));
+	});
+
+	if(limit <= 0.0) {
+		return 0;
+	}
+	const auto n = static_cast<unsigned>(limit);
+	return (static_cast<double>(n) < limit) ? n + 1 : n;
+}
+
+
+// Cgroup memory limit in bytes.  0 : unlimited.
+uint64_t getCgroupMemoryLimit() {
+	// NOTE : cgroup v1 reports "unlimited" as a huge page aligned number.
+	const uint64_t unlimited = uint64_t(1) << 60;
+	uint64_t limit = 0;
+	const auto update = [&](const std::string& value) {
+		const auto v = static_cast<uint64_t>(strtoull(value.c_str(), nullptr, 10));
+		if(v > 0 && v < unlimited && (0 == limit || v < limit)) {
+			limit = v;
+		}
+	};
+
+	forEachCgroupDir("", [&](const std::string& dir) {
+		update(readCgroupValue(dir + "memory.max"));		// v2 : "max" or bytes
+	});
+	forEachCgroupDir("memory", [&](const std::string& dir) {
+		update(readCgroupValue(dir + "memory.limit_in_bytes"));
+	});
+	return limit;
+}
+
+
+// Default huge page size in bytes.  0 : no hugetlbfs.
+size_t readHugePageSize() {
+	// NOTE : "Hugepagesize:    2048 kB"
+	const std::string key = "Hugepagesize:";
+	std::ifstream ifs("/proc/meminfo");
+	std::string line;
+	while(std::getline(ifs, line)) {
+		if(0 == line.compare(0, key.size(), key)) {
+			const auto kb = strtoull(line.c_str() + key.size(), nullptr, 10);
+			return static_cast<size_t>(kb) * 1024;
+		}
+	}
+	return 0;
+}
+#endif // __linux__
+
+
+// Huge page size of allocPages().  0 : no huge pages.
+size_t getHugePageSize() {
+#if defined(_WIN32)
+	return static_cast<size_t>(GetLargePageMinimum());
+#elif defined(__linux__)
+	static const size_t hugePageSize = readHugePageSize();
+	return hugePageSize;
+#else
+	return 0;
+#endif
+}
+
+
+size_t roundUp(size_t size, size_t unit) {
+	return unit ? (size + unit - 1) / unit * unit : size;
+}
+
+
+// NOTE : A huge page for a smaller buffer would mostly be wasted (-B4
+//        is 1/32 of a 2 MiB page), so such buffers get normal pages.
+//        allocPages() and freePages() both round to getHugePageSize(),
+//        so munmap() gets the length mmap() got.
+bool isHugePageSize(size_t size, bool hugePages) {
+	const auto hugePageSize = getHugePageSize();
+	return hugePages && hugePageSize && size >= hugePageSize;
+}
+
+} // anonymous namespace
+
+
 unsigned Lz4Mt::getHardwareConcurrency() {
+	unsigned c = 0;
 	{
-		const auto c = std::thread::hardware_concurrency();
-		if(c) {
-			return static_cast<unsigned>(c);
+		c = static_cast<unsigned>(std::thread::hardware_concurrency());
+	}
+
+#if defined(__linux__)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if(0 == sched_getaffinity(0, sizeof(set), &set)) {
+			const auto n = static_cast<unsigned>(CPU_COUNT(&set));
+			if(n && (0 == c || n < c)) {
+				c = n;
+			}
+		}
+	}
+	{
+		const auto n = getCgroupCpuLimit();
+		if(n && (0 == c || n < c)) {
+			c = n;
 		}
 	}
+#endif
+
+	if(c) {
+		return c;
+	}
 
 	// following code is borrowed from boost-1.53.0/libs/thread/src/pthread/thread.cpp
 #if defined(__APPLE__) || defined(__FreeBSD__)
@@ -60,3 +271,186 @@ unsigned Lz4Mt::getHardwareConcurrency() {
 	assert(0);
 	return 8;
 }
+
+
+uint64_t Lz4Mt::getMemoryLimit() {
+#if defined(__linux__)
+	return getCgroupMemoryLimit();
+#else
+	return 0;
+#endif
+}
+
+
+bool Lz4Mt::parseCpuList(const std::string& s, std::vector<unsigned>& cpus) {
+	cpus.clear();
+	size_t pos = 0;
+	while(pos < s.size()) {
+		const auto end = s.find(',', pos);
+		const auto item = s.substr(pos, std::string::npos == end ? std::string::npos : end - pos);
+		pos = std::string::npos == end ? s.size() : end + 1;
+
+		char* p = nullptr;
+		const auto first = strtoul(item.c_str(), &p, 10);
+		auto last = first;
+		if(p == item.c_str()) {
+			return false;
+		}
+		if('-' == *p) {
+			const char* q = p + 1;
+			last = strtoul(q, &p, 10);
+			if(p == q || last < first) {
+				return false;
+			}
+		}
+		if(0 != *p) {
+			return false;
+		}
+		for(auto c = first; c <= last; ++c) {
+			cpus.push_back(static_cast<unsigned>(c));
+		}
+	}
+	return !cpus.empty();
+}
+
+
+bool Lz4Mt::setCurrentThreadAffinity(unsigned cpu) {
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return 0 == pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+	(void) cpu;
+	return false;
+#endif
+}
+
+
+unsigned Lz4Mt::getNumaNodeCount() {
+	unsigned n = 0;
+#if defined(__linux__)
+	if(auto* dir = opendir("/sys/devices/system/node")) {
+		while(const auto* e = readdir(dir)) {
+			const std::string name(e->d_name);
+			if(0 == name.compare(0, 4, "node")
+			   && name.size() > 4
+			   && std::isdigit(static_cast<unsigned char>(name[4]))
+			) {
+				++n;
+			}
+		}
+		closedir(dir);
+	}
+#endif
+	return n ? n : 1;
+}
+
+
+int Lz4Mt::getCurrentNumaNode() {
+#if defined(__linux__) && defined(SYS_getcpu)
+	unsigned cpu = 0;
+	unsigned node = 0;
+	if(0 == syscall(SYS_getcpu, &cpu, &node, nullptr)) {
+		return static_cast<int>(node);
+	}
+#endif
+	return -1;
+}
+
+
+int Lz4Mt::getNumaNodeOfAddress(const void* ptr) {
+#if defined(__linux__) && defined(SYS_get_mempolicy)
+	const int MPOL_F_NODE = 1 << 0;
+	const int MPOL_F_ADDR = 1 << 1;
+	int node = -1;
+	if(0 == syscall(SYS_get_mempolicy, &node, nullptr, 0, ptr, MPOL_F_NODE | MPOL_F_ADDR)) {
+		return node;
+	}
+#else
+	(void) ptr;
+#endif
+	return -1;
+}
+
+
+bool Lz4Mt::bindToNumaNode(void* ptr, size_t size, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+	const int MPOL_PREFERRED = 1;
+	const unsigned MPOL_MF_MOVE = 1 << 1;
+	const auto pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+	const auto b = (reinterpret_cast<uintptr_t>(ptr) + pageSize - 1) & ~(pageSize - 1);
+	const auto e = (reinterpret_cast<uintptr_t>(ptr) + size) & ~(pageSize - 1);
+	if(node < 0 || node >= 64 || e <= b) {
+		return false;
+	}
+	const unsigned long nodeMask = 1UL << node;
+	return 0 == syscall(SYS_mbind, b, e - b, MPOL_PREFERRED
+						, &nodeMask, sizeof(nodeMask) * 8, MPOL_MF_MOVE);
+#else
+	(void) ptr;
+	(void) size;
+	(void) node;
+	return false;
+#endif
+}
+
+
+void* Lz4Mt::allocPages(size_t size, bool hugePages) {
+	hugePages = isHugePageSize(size, hugePages);
+	if(hugePages) {
+		size = roundUp(size, getHugePageSize());
+	}
+#if defined(_WIN32)
+	if(hugePages) {
+		// NOTE : MEM_LARGE_PAGES needs SeLockMemoryPrivilege.
+		if(auto* p = VirtualAlloc(nullptr, size
+			, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) {
+			return p;
+		}
+	}
+	return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(__unix__) || defined(__APPLE__)
+	const int prot = PROT_READ | PROT_WRITE;
+	const int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#if defined(MAP_HUGETLB)
+	if(hugePages) {
+		// NOTE : Fails unless huge pages are reserved (vm.nr_hugepages).
+		auto* p = mmap(nullptr, size, prot, flags | MAP_HUGETLB, -1, 0);
+		if(MAP_FAILED != p) {
+			return p;
+		}
+	}
+#endif
+	auto* p = mmap(nullptr, size, prot, flags, -1, 0);
+	if(MAP_FAILED == p) {
+		return nullptr;
+	}
+#if defined(MADV_HUGEPAGE)
+	if(hugePages) {
+		madvise(p, size, MADV_HUGEPAGE);
+	}
+#endif
+	return p;
+#else
+	return new (std::nothrow) char[size];
+#endif
+}
+
+
+void Lz4Mt::freePages(void* ptr, size_t size, bool hugePages) {
+	if(nullptr == ptr) {
+		return;
+	}
+#if defined(_WIN32)
+	(void) size;
+	(void) hugePages;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#elif defined(__unix__) || defined(__APPLE__)
+	munmap(ptr, isHugePageSize(size, hugePages) ? roundUp(size, getHugePageSize()) : size);
+#else
+	(void) size;
+	(void) hugePages;
+	delete [] static_cast<char*>(ptr);
+#endif
+}
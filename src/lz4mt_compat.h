@@ -1,10 +1,43 @@
 #ifndef LZ4MT_COMPAT_H
 #define LZ4MT_COMPAT_H
 
+#include <future>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
 namespace Lz4Mt {
 
+// Number of CPUs this process may actually use : the smallest of the
+// online CPUs, the sched_getaffinity() mask and the cgroup (v1 or v2) CPU
+// quota, rounded up.
 unsigned getHardwareConcurrency();
 
+// Memory limit of this process's cgroup (v1 or v2) in bytes.  0 : unlimited.
+uint64_t getMemoryLimit();
+
+// "0-3,8,10-11" -> { 0, 1, 2, 3, 8, 10, 11 }
+bool parseCpuList(const std::string& s, std::vector<unsigned>& cpus);
+
+// Pin the calling thread to 'cpu'.  Returns false when not supported.
+bool setCurrentThreadAffinity(unsigned cpu);
+
+// NUMA helpers.  Without NUMA support, there is one node (0), and
+// -1 is returned as "unknown".
+unsigned getNumaNodeCount();
+int getCurrentNumaNode();
+int getNumaNodeOfAddress(const void* ptr);
+bool bindToNumaNode(void* ptr, size_t size, int node);
+
+// Page aligned memory which is not initialized by us : pages are touched
+// first by whoever uses them.  hugePages : try huge pages (MAP_HUGETLB,
+// then transparent huge pages / MEM_LARGE_PAGES), falling back to normal
+// pages.  Only sizes of at least one huge page use them.  Pass the same
+// 'size' and 'hugePages' to freePages().
+// Returns nullptr on failure.
+void* allocPages(size_t size, bool hugePages);
+void freePages(void* ptr, size_t size, bool hugePages);
+
 struct launch {
 #if defined(_MSC_VER) && (_MSC_VER <= 1700)
 	typedef std::launch::launch Type;
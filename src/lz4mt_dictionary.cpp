@@ -0,0 +1,107 @@
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "lz4mt_dictionary.h"
+
+#include "lz4.h"
+#include "lz4hc.h"
+#include <string.h>
+
+namespace {
+typedef std::unique_lock<std::mutex> Lock;
+
+const size_t DICTIONARY_MAX_SIZE = 64 * 1024;
+
+bool isHc(int compressionLevel) {
+	return compressionLevel >= 3;
+}
+
+std::vector<char> getTail(const void* dict, size_t dictSize) {
+	const auto* p = reinterpret_cast<const char*>(dict);
+	const auto n = std::min(dictSize, DICTIONARY_MAX_SIZE);
+	return std::vector<char>(p + dictSize - n, p + dictSize);
+}
+} // anonymous namespace
+
+
+Lz4MtDictionary::Lz4MtDictionary(const void* dict, size_t dictSize)
+	: buffer(getTail(dict, dictSize))
+	, mut()
+	, states()
+{}
+
+
+const char* Lz4MtDictionary::data() const {
+	return buffer.data();
+}
+
+
+int Lz4MtDictionary::size() const {
+	return static_cast<int>(buffer.size());
+}
+
+
+void Lz4MtDictionary::loadState(void* lz4Ctx, int compressionLevel) const {
+	// NOTE : Every fast level shares one state.
+	const auto key = isHc(compressionLevel) ? compressionLevel : 0;
+	const char* state = nullptr;
+	{
+		Lock lock(mut);
+		auto& s = states[key];
+		if(! s) {
+			s.reset(new char[getStateSize(compressionLevel)]);
+			if(isHc(compressionLevel)) {
+				auto* p = reinterpret_cast<LZ4_streamHC_t*>(s.get());
+				LZ4_resetStreamHC(p, compressionLevel);
+				LZ4_loadDictHC(p, data(), size());
+			} else {
+				auto* p = reinterpret_cast<LZ4_stream_t*>(s.get());
+				LZ4_resetStream(p);
+				LZ4_loadDict(p, data(), size());
+			}
+		}
+		state = s.get();
+	}
+	// NOTE : A state never changes once it's made.
+	memcpy(lz4Ctx, state, getStateSize(compressionLevel));
+}
+
+
+int Lz4MtDictionary::compress(
+	  void* lz4Ctx, const char* src, char* dst
+	, int srcSize, int maxOutputSize, int compressionLevel
+) const {
+	loadState(lz4Ctx, compressionLevel);
+	if(isHc(compressionLevel)) {
+		return LZ4_compress_HC_continue(
+			reinterpret_cast<LZ4_streamHC_t*>(lz4Ctx), src, dst, srcSize, maxOutputSize);
+	} else {
+		return LZ4_compress_fast_continue(
+			  reinterpret_cast<LZ4_stream_t*>(lz4Ctx), src, dst, srcSize, maxOutputSize
+			, compressionLevel < 0 ? -compressionLevel : 1);
+	}
+}
+
+
+size_t Lz4MtDictionary::getStateSize(int compressionLevel) {
+	return isHc(compressionLevel) ? sizeof(LZ4_streamHC_t) : sizeof(LZ4_stream_t);
+}
+
+
+extern "C" Lz4MtDictionary*
+lz4mtCreateDictionary(const void* dict, size_t dictSize)
+{
+	if(nullptr == dict && 0 != dictSize) {
+		return nullptr;
+	}
+	return new Lz4MtDictionary(dict, dictSize);
+}
+
+
+extern "C" void
+lz4mtDestroyDictionary(Lz4MtDictionary* dictionary)
+{
+	delete dictionary;
+}
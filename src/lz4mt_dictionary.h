@@ -0,0 +1,43 @@
+#ifndef LZ4MT_DICTIONARY_H
+#define LZ4MT_DICTIONARY_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "lz4mt.h"
+
+// Preset dictionary.  Only its last 64 KiB can be referred to, so only
+// those are kept.
+//
+// The LZ4 / LZ4HC stream state after loading the dictionary ("digested"
+// state) is made once for each compression level, and copied into the
+// stream of every block which starts with the dictionary.
+struct Lz4MtDictionary {
+	Lz4MtDictionary(const void* dict, size_t dictSize);
+
+	const char* data() const;
+	int size() const;
+
+	// Copy the digested state into 'lz4Ctx' : LZ4_streamHC_t when
+	// compressionLevel >= 3, LZ4_stream_t otherwise.
+	void loadState(void* lz4Ctx, int compressionLevel) const;
+
+	// Compress 'src' as a block which follows the dictionary.  'lz4Ctx' is
+	// scratch space of getStateSize(compressionLevel) bytes.
+	int compress(
+		  void* lz4Ctx, const char* src, char* dst
+		, int srcSize, int maxOutputSize, int compressionLevel) const;
+
+	static size_t getStateSize(int compressionLevel);
+
+private:
+	Lz4MtDictionary(const Lz4MtDictionary&);
+	const Lz4MtDictionary& operator=(const Lz4MtDictionary&);
+
+	const std::vector<char> buffer;
+	mutable std::mutex mut;
+	mutable std::map<int, std::unique_ptr<char[]>> states;
+};
+
+#endif // LZ4MT_DICTIONARY_H
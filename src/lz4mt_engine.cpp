@@ -0,0 +1,81 @@
+#include <cassert>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include "lz4mt_engine.h"
+#include "lz4mt_compat.h"
+
+namespace {
+typedef std::unique_lock<std::mutex> Lock;
+} // anonymous namespace
+
+
+namespace Lz4Mt {
+
+Budget::Budget(uint64_t limit)
+	: limit(limit)
+	, inUse(0)
+	, mut()
+	, cond()
+{}
+
+
+uint64_t Budget::clamp(uint64_t size) const {
+	return (limit && size > limit) ? limit : size;
+}
+
+
+void Budget::acquire(uint64_t size) {
+	const auto s = clamp(size);
+	Lock lock(mut);
+	while(limit && inUse + s > limit) {
+		cond.wait(lock);
+	}
+	inUse += s;
+}
+
+
+void Budget::release(uint64_t size) {
+	const auto s = clamp(size);
+	{
+		Lock lock(mut);
+		assert(inUse >= s);
+		inUse -= s;
+	}
+	cond.notify_all();
+}
+
+
+uint64_t Budget::used() const {
+	Lock lock(mut);
+	return inUse;
+}
+
+} // namespace Lz4Mt
+
+
+Lz4MtEngine::Lz4MtEngine(unsigned nThread, uint64_t bufferBudget, const std::vector<unsigned>& cpus)
+	: threadPool(nThread, cpus)
+	, budget(bufferBudget)
+{}
+
+
+extern "C" Lz4MtEngine*
+lz4mtCreateEngine(int nThread, uint64_t bufferBudget, const char* cpuList)
+{
+	std::vector<unsigned> cpus;
+	if(cpuList && ! Lz4Mt::parseCpuList(cpuList, cpus)) {
+		return nullptr;
+	}
+	const auto n = nThread > 0
+		? static_cast<unsigned>(nThread)
+		: Lz4Mt::getHardwareConcurrency();
+	return new Lz4MtEngine(n, bufferBudget, cpus);
+}
+
+
+extern "C" void
+lz4mtDestroyEngine(Lz4MtEngine* engine)
+{
+	delete engine;
+}
@@ -0,0 +1,52 @@
+#ifndef LZ4MT_ENGINE_H
+#define LZ4MT_ENGINE_H
+
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+#include <stdint.h>
+#include "lz4mt.h"
+#include "lz4mt_threadpool.h"
+
+namespace Lz4Mt {
+
+// Counting semaphore of bytes.  limit == 0 means unlimited.
+// A request larger than the limit is clamped to the limit, so a single
+// block always fits into an otherwise idle budget.
+class Budget {
+public:
+	explicit Budget(uint64_t limit);
+
+	void acquire(uint64_t size);
+	void release(uint64_t size);
+	uint64_t used() const;
+
+private:
+	Budget(const Budget&);
+	const Budget& operator=(const Budget&);
+
+	uint64_t clamp(uint64_t size) const;
+
+	const uint64_t limit;
+	uint64_t inUse;
+	mutable std::mutex mut;
+	std::condition_variable cond;
+};
+
+} // namespace Lz4Mt
+
+
+// Shared engine : one worker set and one buffer budget for every
+// Lz4MtContext attached to it.
+struct Lz4MtEngine {
+	Lz4MtEngine(unsigned nThread, uint64_t bufferBudget, const std::vector<unsigned>& cpus);
+
+	Lz4Mt::ThreadPool threadPool;
+	Lz4Mt::Budget budget;
+
+private:
+	Lz4MtEngine(const Lz4MtEngine&);
+	const Lz4MtEngine& operator=(const Lz4MtEngine&);
+};
+
+#endif // LZ4MT_ENGINE_H
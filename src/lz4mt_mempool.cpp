@@ -2,30 +2,40 @@
 #include <atomic>
 #include <future>
 #include <mutex>
+#include <thread>
 #include <vector>
 #include "lz4mt_mempool.h"
+#include "lz4mt_compat.h"
 
 namespace {
 typedef std::unique_lock<std::mutex> Lock;
+
+const int SPIN_COUNT = 64;
+const uint64_t INDEX_MASK = 0xffffffffULL;
 } // anonymous namespace
 
 
 namespace Lz4Mt {
 
-MemPool::MemPool(size_t elementSize, size_t elementCount)
-	: stop(false)
+MemPool::MemPool(size_t elementSize, size_t elementCount, int node
+	, Counters* counters, bool hugePages, Allocator* allocator)
+	: elementSize(elementSize)
+	, elementCount(elementCount)
+	, node(node)
+	, counters(counters)
+	, hugePages(hugePages)
+	, allocator(allocator)
+	, buffers(new Buffer[elementCount])
+	, head(0)
+	, nCreated(0)
+	, nAlloc(0)
+	, nFree(0)
+	, nWait(0)
+	, stop(false)
+	, nWaiter(0)
 	, mut()
 	, cond()
-	, freeIndexStack()
-	, elements()
-{
-	Lock lock(mut);
-	elements.reserve(elementCount);
-	for(size_t i = 0; i < elementCount; ++i) {
-		elements.emplace_back(elementSize);
-		freeIndexStack.push(static_cast<int>(i));
-	}
-}
+{}
 
 
 MemPool::~MemPool() {
@@ -34,44 +44,169 @@ MemPool::~MemPool() {
 		stop = true;
 	}
 	cond.notify_all();
+
+	if(counters) {
+		counters->allocs += nAlloc;
+		counters->frees += nFree;
+		counters->waits += nWait;
+	}
+
+	for(size_t i = 0; i < nCreated; ++i) {
+		if(nullptr == buffers[i].ptr) {
+			continue;
+		}
+		if(allocator) {
+			allocator->deallocate(buffers[i].ptr, elementSize);
+		} else {
+			freePages(buffers[i].ptr, elementSize, hugePages);
+		}
+	}
 }
 
 
-MemPool::Buffer* MemPool::alloc() {
-	for(;;) {
+MemPool::BufferPtr MemPool::alloc() {
+	bool parked = false;
+	for(int spin = 0; ; ++spin) {
+		if(stop) {
+			return BufferPtr();
+		}
+
+		bool failed = false;
+		auto* b = pop();
+		if(nullptr == b) {
+			b = create(failed);
+		}
+		if(failed) {
+			return BufferPtr();
+		}
+		if(b) {
+			b->contentSize = elementSize;
+			nAlloc.fetch_add(1, std::memory_order_relaxed);
+			return BufferPtr(b);
+		}
+
+		if(spin < SPIN_COUNT) {
+			std::this_thread::yield();
+			continue;
+		}
+
+		// NOTE : release() notifies only when it sees a waiter, therefore
+		//        the waiter is counted before the free list is checked.
 		Lock lock(mut);
-		if(!stop && freeIndexStack.empty()) {
+		++nWaiter;
+		if(! parked) {
+			parked = true;
+			nWait.fetch_add(1, std::memory_order_relaxed);
+		}
+		while(!stop && 0 == (head & INDEX_MASK)) {
 			cond.wait(lock);
 		}
-		if(stop) {
-			return new Buffer(nullptr, 0, []{});
+		--nWaiter;
+		spin = 0;
+	}
+}
+
+
+// New element, or nullptr when all of them have been created.  'failed' :
+// its memory couldn't be allocated, and the element is lost.
+MemPool::Buffer* MemPool::create(bool& failed) {
+	auto n = nCreated.load();
+	while(n < elementCount && !nCreated.compare_exchange_weak(n, n + 1)) {
+	}
+	if(n >= elementCount) {
+		return nullptr;
+	}
+
+	auto& b = buffers[n];
+	if(allocator) {
+		b.ptr = static_cast<char*>(allocator->allocate(elementSize));
+	} else {
+		b.ptr = static_cast<char*>(allocPages(elementSize, hugePages));
+		if(b.ptr && node >= 0) {
+			bindToNumaNode(b.ptr, elementSize, node);
 		}
-		if(! freeIndexStack.empty()) {
-			const auto i = freeIndexStack.top();
-			freeIndexStack.pop();
-			auto& e = elements[i];
-			return new Buffer(e.data(), e.size()
-				, [this, &e, i]() {
-					Lock lock(mut);
-					freeIndexStack.push(i);
-					cond.notify_one();
-				}
-			);
+	}
+	if(nullptr == b.ptr) {
+		failed = true;
+		return nullptr;
+	}
+	b.pool = this;
+	return &b;
+}
+
+
+uint64_t MemPool::allocCount() const {
+	return nAlloc;
+}
+
+
+uint64_t MemPool::freeCount() const {
+	return nFree;
+}
+
+
+uint64_t MemPool::waitCount() const {
+	return nWait;
+}
+
+
+// Treiber stack.  'head' carries a tag which changes on every update, so
+// a stale compare_exchange (ABA) always fails.
+MemPool::Buffer* MemPool::pop() {
+	auto h = head.load();
+	for(;;) {
+		const auto index = static_cast<uint32_t>(h & INDEX_MASK);
+		if(0 == index) {
+			return nullptr;
+		}
+		auto* b = &buffers[index - 1];
+		const uint64_t next = b->next.load();
+		const auto h2 = ((((h >> 32) + 1) & INDEX_MASK) << 32) | next;
+		if(head.compare_exchange_weak(h, h2)) {
+			return b;
 		}
 	}
 }
 
 
-MemPool::Buffer::Buffer(char* ptr, size_t contentSize, Callback callback)
-	: ptr(ptr)
-	, contentSize(contentSize)
-	, callback(callback)
-{}
+void MemPool::push(Buffer* b) {
+	const auto index = static_cast<uint64_t>(b - buffers.get()) + 1;
+	auto h = head.load();
+	for(;;) {
+		b->next.store(static_cast<uint32_t>(h & INDEX_MASK));
+		const auto h2 = ((((h >> 32) + 1) & INDEX_MASK) << 32) | index;
+		if(head.compare_exchange_weak(h, h2)) {
+			return;
+		}
+	}
+}
+
 
-MemPool::Buffer::~Buffer() {
-	callback();
+void MemPool::release(Buffer* b) {
+	nFree.fetch_add(1, std::memory_order_relaxed);
+	push(b);
+	if(nWaiter > 0) {
+		Lock lock(mut);
+		cond.notify_one();
+	}
 }
 
+
+void MemPool::Release::operator()(Buffer* buffer) const {
+	if(auto* pool = buffer->pool) {
+		pool->release(buffer);
+	}
+}
+
+
+MemPool::Buffer::Buffer()
+	: pool(nullptr)
+	, ptr(nullptr)
+	, contentSize(0)
+	, next(0)
+	, refs(0)
+{}
+
 char* MemPool::Buffer::data() const {
 	return ptr;
 }
@@ -85,4 +220,54 @@ void MemPool::Buffer::resize(size_t contentSize) {
 }
 
 
+MemPool::SharedBufferPtr::SharedBufferPtr()
+	: buffer(nullptr)
+{}
+
+MemPool::SharedBufferPtr::SharedBufferPtr(BufferPtr&& x)
+	: buffer(x.release())
+{
+	if(buffer) {
+		buffer->refs.store(1, std::memory_order_relaxed);
+	}
+}
+
+MemPool::SharedBufferPtr::SharedBufferPtr(const SharedBufferPtr& x)
+	: buffer(x.buffer)
+{
+	if(buffer) {
+		buffer->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+MemPool::SharedBufferPtr::SharedBufferPtr(SharedBufferPtr&& x)
+	: buffer(x.buffer)
+{
+	x.buffer = nullptr;
+}
+
+MemPool::SharedBufferPtr::~SharedBufferPtr() {
+	reset();
+}
+
+MemPool::SharedBufferPtr& MemPool::SharedBufferPtr::operator=(SharedBufferPtr x) {
+	std::swap(buffer, x.buffer);
+	return *this;
+}
+
+MemPool::Buffer* MemPool::SharedBufferPtr::get() const {
+	return buffer;
+}
+
+MemPool::Buffer* MemPool::SharedBufferPtr::operator->() const {
+	return buffer;
+}
+
+void MemPool::SharedBufferPtr::reset() {
+	if(buffer && 1 == buffer->refs.fetch_sub(1, std::memory_order_acq_rel)) {
+		Release()(buffer);
+	}
+	buffer = nullptr;
+}
+
 } // namespace Lz4Mt
@@ -1,46 +1,136 @@
 #ifndef LZ4MT_MEMPOOL_H
 #define LZ4MT_MEMPOOL_H
 
-#include <stack>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
 
 namespace Lz4Mt {
 
+// Source of large buffers and codec state.
+class Allocator {
+public:
+	virtual ~Allocator() {}
+	virtual void* allocate(size_t size) = 0;		// nullptr : out of memory
+	virtual void deallocate(void* ptr, size_t size) = 0;
+};
+
+// Fixed size buffer pool.
+//
+// Buffers are handed out through a lock-free free list, and their handles
+// live in the pool itself, so alloc() and release neither lock nor touch
+// the heap.  When every element is in use, alloc() spins for a while,
+// then parks until a buffer comes back.  alloc() returns nullptr when
+// the memory of a new element can't be allocated, or after the pool has
+// been stopped.
+//
+// Elements are created on demand, up to 'elementCount', so a small input
+// only pays for the buffers it actually uses.  Each element is its own
+// page aligned (optionally huge page) mapping, which isn't initialized
+// here : pages are faulted in only when a buffer is first written.  The
+// most recently released buffer is reused first.
 class MemPool {
 public:
 	class Buffer;
 
-	MemPool(size_t elementSize, size_t elementCount);
+	struct Release {
+		void operator()(Buffer* buffer) const;
+	};
+
+	typedef std::unique_ptr<Buffer, Release> BufferPtr;
+	class SharedBufferPtr;
+
+	// Totals of one or more pools, added when each pool is destroyed.
+	struct Counters {
+		Counters() : allocs(0), frees(0), waits(0) {}
+		std::atomic<uint64_t> allocs;
+		std::atomic<uint64_t> frees;
+		std::atomic<uint64_t> waits;	// alloc() calls which had to park
+	};
+
+	// node >= 0 : Elements prefer the memory of NUMA node 'node'.
+	// hugePages : Back the elements with huge pages when available, and
+	//             elementSize is at least one huge page.
+	// allocator : Source of the elements instead of allocPages().  Then
+	//             'node' and 'hugePages' are up to the allocator.
+	MemPool(size_t elementSize, size_t elementCount, int node = -1
+		, Counters* counters = nullptr, bool hugePages = false
+		, Allocator* allocator = nullptr);
 	~MemPool();
-	Buffer* alloc();
+	BufferPtr alloc();
 
-	class Buffer {
-		typedef std::function<void(void)> Callback;
+	uint64_t allocCount() const;
+	uint64_t freeCount() const;
+	uint64_t waitCount() const;
 
+	class Buffer {
 	public:
-		Buffer(char* ptr, size_t contentSize, Callback callback);
-		~Buffer();
 		char* data() const;
 		size_t size() const;
 		void resize(size_t contentSize);
 
 	private:
+		friend class MemPool;
+		friend class SharedBufferPtr;
+		Buffer();
 		Buffer(const Buffer&);
 		const Buffer& operator=(const Buffer&);
 
+		MemPool* pool;				// nullptr : not pooled
 		char* ptr;
 		size_t contentSize;
-		Callback callback;
+		std::atomic<uint32_t> next;	// Free list link (index + 1)
+		std::atomic<uint32_t> refs;	// Owners of SharedBufferPtr
+	};
+
+	// Shared ownership of a Buffer.  The count lives in the Buffer, so there
+	// is no control block to allocate.
+	class SharedBufferPtr {
+	public:
+		SharedBufferPtr();
+		SharedBufferPtr(BufferPtr&& buffer);
+		SharedBufferPtr(const SharedBufferPtr& x);
+		SharedBufferPtr(SharedBufferPtr&& x);
+		~SharedBufferPtr();
+		SharedBufferPtr& operator=(SharedBufferPtr x);
+
+		Buffer* get() const;
+		Buffer* operator->() const;
+		void reset();
+
+	private:
+		Buffer* buffer;
 	};
 
 private:
-	typedef std::vector<char> Element;
+	MemPool(const MemPool&);
+	const MemPool& operator=(const MemPool&);
+
+	Buffer* pop();
+	Buffer* create(bool& failed);
+	void push(Buffer* buffer);
+	void release(Buffer* buffer);
+
+	const size_t elementSize;
+	const size_t elementCount;
+	const int node;
+	Counters* const counters;
+	const bool hugePages;
+	Allocator* const allocator;
+	std::unique_ptr<Buffer[]> buffers;
+
+	std::atomic<uint64_t> head;			// (tag << 32) | (index + 1)
+	std::atomic<size_t> nCreated;
+	std::atomic<uint64_t> nAlloc;
+	std::atomic<uint64_t> nFree;
+	std::atomic<uint64_t> nWait;
 
 	std::atomic<bool> stop;
-	mutable std::mutex mut;
+	std::atomic<unsigned> nWaiter;
+	std::mutex mut;
 	std::condition_variable cond;
-
-	std::stack<int> freeIndexStack;
-	std::vector<Element> elements;
 };
 
 } // namespace Lz4Mt
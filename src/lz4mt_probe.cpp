@@ -0,0 +1,71 @@
+#include <string.h>
+#include "lz4.h"
+#include "lz4mt_probe.h"
+
+namespace {
+
+const int SLICE_SIZE = 4 * 1024;
+const int MAX_SLICES = 8;
+// NOTE : One slice for each 128 KiB, so small blocks pay about the same.
+const int BYTES_PER_SLICE = 32 * SLICE_SIZE;
+
+struct Magic {
+	int			size;
+	const char*	bytes;
+};
+
+// Formats which are entropy coded right after their magic number.
+const Magic compressedMagics[] = {
+	  { 3, "\xff\xd8\xff" }					// JPEG
+	, { 8, "\x89PNG\r\n\x1a\n" }			// PNG
+	, { 3, "\x1f\x8b\x08" }					// gzip (deflate)
+	, { 3, "BZh" }							// bzip2
+	, { 6, "\xfd" "7zXZ\x00" }				// xz
+	, { 6, "7z\xbc\xaf\x27\x1c" }			// 7z
+	, { 4, "\x28\xb5\x2f\xfd" }				// zstd
+	, { 4, "\x04\x22\x4d\x18" }				// LZ4 frame
+	, { 4, "\x02\x21\x4c\x18" }				// LZ4 legacy
+};
+
+bool hasCompressedMagic(const char* src, int srcSize) {
+	for(const auto& m : compressedMagics) {
+		if(srcSize >= m.size && 0 == memcmp(src, m.bytes, m.size)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+} // anonymous namespace
+
+
+namespace Lz4Mt {
+
+bool isIncompressible(void* lz4State, const char* src, int srcSize) {
+	if(srcSize < 2 * SLICE_SIZE) {
+		return false;
+	}
+
+	// NOTE : A known magic number makes a compressed file likely, but the
+	//        block may still end with something else (e.g. an archive),
+	//        so the head and the tail are tried anyway.
+	int nSlice = hasCompressedMagic(src, srcSize) ? 2 : srcSize / BYTES_PER_SLICE;
+	if(nSlice < 2) {
+		nSlice = 2;
+	} else if(nSlice > MAX_SLICES) {
+		nSlice = MAX_SLICES;
+	}
+
+	const int maxOutputSize = SLICE_SIZE - SLICE_SIZE / 32;
+	char dst[SLICE_SIZE];
+	const int step = (srcSize - SLICE_SIZE) / (nSlice - 1);
+	for(int i = 0; i < nSlice; ++i) {
+		const auto* p = src + i * step;
+		if(LZ4_compress_fast_extState(lz4State, p, dst, SLICE_SIZE, maxOutputSize, 1) > 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+} // namespace Lz4Mt
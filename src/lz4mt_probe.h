@@ -0,0 +1,19 @@
+#ifndef LZ4MT_PROBE_H
+#define LZ4MT_PROBE_H
+
+namespace Lz4Mt {
+
+// Whether LZ4 compression of 'src' looks doomed : a few slices spread over
+// the block are compressed alone, and none of them saves 1/32 of its size.
+// Fewer slices are tried when 'src' starts with the magic number of a
+// compressed format (JPEG, PNG, gzip, zstd, xz, ...).  'lz4State' is scratch
+// space of at least LZ4_sizeofState() bytes.
+//
+// It stops at the first slice which compresses, so a compressible block
+// usually costs one 4 KiB slice.  Small blocks are never reported as
+// incompressible.
+bool isIncompressible(void* lz4State, const char* src, int srcSize);
+
+} // namespace Lz4Mt
+
+#endif
@@ -81,6 +81,12 @@ lz4mtResultToString(Lz4MtResult result)
 	case LZ4MT_RESULT_CANNOT_WRITE_DECODED_BLOCK:
 		s = "CANNOT_WRITE_DECODED_BLOCK";
 		break;
+	case LZ4MT_RESULT_PRESET_DICTIONARY_NOT_FOUND:
+		s = "PRESET_DICTIONARY_NOT_FOUND";
+		break;
+	case LZ4MT_RESULT_CANNOT_ALLOCATE:
+		s = "CANNOT_ALLOCATE";
+		break;
 	default:
 		s = "Unknown code";
 		break;
@@ -255,9 +261,14 @@ lz4mtResultToLz4cExitCode(Lz4MtResult result) {
 		e = 78;
 		break;
 
-	default:
+	case LZ4MT_RESULT_CANNOT_ALLOCATE:
 		//	LZ4IO_compressFilename_Legacy()
 		//		if (!in_buff || !out_buff) EXM_THROW(21, "Allocation error : not enough memory");
+		e = 21;
+		break;
+
+	default:
+		//	LZ4IO_compressFilename_Legacy()
 		//		if (sizeCheck!=MAGICNUMBER_SIZE) EXM_THROW(22, "Write error : cannot write header");
 		//
 		//	decodeLZ4S()
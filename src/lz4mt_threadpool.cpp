@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "lz4mt_threadpool.h"
+#include "lz4mt_compat.h"
+
+namespace {
+typedef std::unique_lock<std::mutex> Lock;
+
+const uint64_t STRIDE_BASE = 1 << 20;
+} // anonymous namespace
+
+
+namespace Lz4Mt {
+
+ThreadPool::Queue::Queue(ThreadPool& threadPool, unsigned weight, int node)
+	: threadPool(threadPool)
+	, node(node)
+	, stride(STRIDE_BASE / std::max(weight, 1U))
+	, pass(0)
+	, tasks()
+{
+	Lock lock(threadPool.mut);
+	threadPool.queues.push_back(this);
+}
+
+
+ThreadPool::Queue::~Queue() {
+	Lock lock(threadPool.mut);
+	assert(tasks.empty());
+	auto& q = threadPool.queues;
+	q.erase(std::remove(q.begin(), q.end(), this), q.end());
+}
+
+
+void ThreadPool::Queue::post(Task task) {
+	if(threadPool.threads.empty()) {
+		task();
+	} else {
+		threadPool.push(this, std::move(task));
+	}
+}
+
+
+ThreadPool& ThreadPool::Queue::pool() const {
+	return threadPool;
+}
+
+
+ThreadPool::ThreadPool(unsigned nThread, const std::vector<unsigned>& cpus)
+	: stop(false)
+	, mut()
+	, cond()
+	, globalPass(0)
+	, leafTasks()
+	, queues()
+	, threads()
+	, workerNodes()
+	, defaultQueue()
+{
+	defaultQueue.reset(new Queue(*this, 1));
+	threads.reserve(nThread);
+	for(unsigned i = 0; i < nThread; ++i) {
+		threads.emplace_back([this, i, cpus] { worker(i, cpus); });
+	}
+
+	// Wait until every worker has reported its node.
+	Lock lock(mut);
+	while(workerNodes.size() < nThread) {
+		cond.wait(lock);
+	}
+	std::sort(workerNodes.begin(), workerNodes.end());
+	workerNodes.erase(std::unique(workerNodes.begin(), workerNodes.end()), workerNodes.end());
+}
+
+
+ThreadPool::~ThreadPool() {
+	{
+		Lock lock(mut);
+		stop = true;
+	}
+	cond.notify_all();
+	for(auto& t : threads) {
+		t.join();
+	}
+}
+
+
+unsigned ThreadPool::size() const {
+	return static_cast<unsigned>(threads.size());
+}
+
+
+const std::vector<int>& ThreadPool::nodes() const {
+	return workerNodes;
+}
+
+
+void ThreadPool::post(Task task) {
+	defaultQueue->post(std::move(task));
+}
+
+
+void ThreadPool::push(Queue* queue, Task task) {
+	{
+		Lock lock(mut);
+		assert(!stop);
+		if(nullptr == queue) {
+			leafTasks.push_back(std::move(task));
+		} else {
+			if(queue->tasks.empty()) {
+				// NOTE : An idle queue doesn't accumulate credit.
+				queue->pass = std::max(queue->pass, globalPass);
+			}
+			queue->tasks.push_back(std::move(task));
+		}
+	}
+	cond.notify_one();
+}
+
+
+// Must be called with 'mut' locked.
+bool ThreadPool::popTask(Task& task, int node) {
+	if(! leafTasks.empty()) {
+		task = std::move(leafTasks.front());
+		leafTasks.pop_front();
+		return true;
+	}
+
+	const auto findQueue = [&](bool anyNode) -> Queue* {
+		Queue* q = nullptr;
+		for(auto* e : queues) {
+			if(   !e->tasks.empty()
+			   && (anyNode || e->node < 0 || e->node == node)
+			   && (nullptr == q || e->pass < q->pass)
+			) {
+				q = e;
+			}
+		}
+		return q;
+	};
+
+	auto* q = findQueue(false);
+	if(nullptr == q) {
+		q = findQueue(true);
+	}
+	if(nullptr == q) {
+		return false;
+	}
+
+	task = std::move(q->tasks.front());
+	q->tasks.pop_front();
+	globalPass = q->pass;
+	q->pass += q->stride;
+	return true;
+}
+
+
+bool ThreadPool::runLeaf() {
+	Task task;
+	{
+		Lock lock(mut);
+		if(leafTasks.empty()) {
+			return false;
+		}
+		task = std::move(leafTasks.front());
+		leafTasks.pop_front();
+	}
+	task();
+	return true;
+}
+
+
+void ThreadPool::worker(unsigned index, const std::vector<unsigned>& cpus) {
+	if(! cpus.empty()) {
+		setCurrentThreadAffinity(cpus[index % cpus.size()]);
+	}
+
+	{
+		Lock lock(mut);
+		workerNodes.push_back(std::max(getCurrentNumaNode(), 0));
+	}
+	cond.notify_all();
+
+	for(;;) {
+		Task task;
+		{
+			const auto node = std::max(getCurrentNumaNode(), 0);
+			Lock lock(mut);
+			while(!popTask(task, node)) {
+				if(stop) {
+					return;
+				}
+				cond.wait(lock);
+			}
+		}
+		task();
+	}
+}
+
+} // namespace Lz4Mt
@@ -0,0 +1,127 @@
+#ifndef LZ4MT_THREADPOOL_H
+#define LZ4MT_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+namespace Lz4Mt {
+
+// Fixed size worker pool.
+//
+// post()        : Normal job without future.
+// enqueue()     : Normal job.  Jobs are started in FIFO order, so a job may
+//                 wait for the result of a job which was enqueued before it.
+// enqueueLeaf() : Short job which never waits for other jobs (e.g. hashing).
+//                 Workers prefer leaf jobs, and wait() runs pending leaf jobs
+//                 on the calling thread, so a job can safely wait for its own
+//                 leaf jobs even when every worker is busy.
+//
+// Normal jobs belong to a Queue.  post() and enqueue() use the pool's own
+// default queue.  When several queues have pending jobs, workers serve them
+// in proportion to their weight (stride scheduling); each queue is FIFO.
+//
+// A queue may be tied to a NUMA node.  Workers prefer queues of their own
+// node (or of no node), and steal from other nodes only when those are empty.
+// When 'cpus' is given, worker i is pinned to cpus[i % cpus.size()].
+//
+// ThreadPool(0) has no worker.  All jobs are executed immediately on the
+// calling thread.
+class ThreadPool {
+public:
+	typedef std::function<void(void)> Task;
+
+	class Queue {
+	public:
+		Queue(ThreadPool& threadPool, unsigned weight, int node = -1);
+		~Queue();
+
+		void post(Task task);
+		ThreadPool& pool() const;
+
+	private:
+		friend class ThreadPool;
+		Queue(const Queue&);
+		const Queue& operator=(const Queue&);
+
+		ThreadPool& threadPool;
+		const int node;
+		const uint64_t stride;
+		uint64_t pass;
+		std::deque<Task> tasks;
+	};
+
+	explicit ThreadPool(unsigned nThread, const std::vector<unsigned>& cpus = std::vector<unsigned>());
+	~ThreadPool();
+
+	unsigned size() const;
+
+	// Distinct NUMA nodes of the workers, sampled when they started.
+	const std::vector<int>& nodes() const;
+
+	void post(Task task);
+
+	template<typename F>
+	auto enqueue(F f) -> std::future<decltype(f())> {
+		return submit(f, false);
+	}
+
+	template<typename F>
+	auto enqueueLeaf(F f) -> std::future<decltype(f())> {
+		return submit(f, true);
+	}
+
+	template<typename T>
+	void wait(std::future<T>& f) {
+		while(!isReady(f) && runLeaf()) {
+		}
+		f.wait();
+	}
+
+private:
+	ThreadPool(const ThreadPool&);
+	const ThreadPool& operator=(const ThreadPool&);
+
+	template<typename F>
+	auto submit(F f, bool leaf) -> std::future<decltype(f())> {
+		typedef decltype(f()) R;
+		const auto task = std::make_shared<std::packaged_task<R()>>(f);
+		auto future = task->get_future();
+		if(threads.empty()) {
+			(*task)();
+		} else {
+			push(leaf ? nullptr : defaultQueue.get(), Task([task] { (*task)(); }));
+		}
+		return future;
+	}
+
+	template<typename T>
+	static bool isReady(std::future<T>& f) {
+		return std::future_status::ready == f.wait_for(std::chrono::seconds(0));
+	}
+
+	void push(Queue* queue, Task task);
+	bool popTask(Task& task, int node);
+	bool runLeaf();
+	void worker(unsigned index, const std::vector<unsigned>& cpus);
+
+	bool stop;
+	mutable std::mutex mut;
+	std::condition_variable cond;
+	uint64_t globalPass;
+	std::deque<Task> leafTasks;
+	std::vector<Queue*> queues;
+	std::vector<std::thread> threads;
+	std::vector<int> workerNodes;
+	std::unique_ptr<Queue> defaultQueue;
+};
+
+} // namespace Lz4Mt
+
+#endif // LZ4MT_THREADPOOL_H
@@ -15,33 +15,38 @@ namespace Lz4Mt {
 
 Xxh32::Xxh32(uint32_t seed)
 	: mut()
-	, st(new char[XXH32_sizeofState()])
+	, st(XXH32_createState())
 {
 	Lock lock(mut);
-	XXH32_resetState(st.get(), seed);
+	if(st) {
+		XXH32_reset(st, seed);
+	}
 }
 
 
 Xxh32::Xxh32(const void* input, int len, uint32_t seed)
 	: mut()
-	, st(new char[XXH32_sizeofState()])
+	, st(XXH32_createState())
 {
 	Lock lock(mut);
-	XXH32_resetState(st.get(), seed);
-	XXH32_update(st.get(), input, len);
+	if(st) {
+		XXH32_reset(st, seed);
+		XXH32_update(st, input, static_cast<size_t>(len));
+	}
 }
 
 
 Xxh32::~Xxh32() {
 	Lock lock(mut); // wait for release
-	st.reset();
+	XXH32_freeState(st);
+	st = nullptr;
 }
 
 
 bool Xxh32::update(const void* input, int len) {
 	Lock lock(mut);
 	if(st) {
-		return XXH_OK == XXH32_update(st.get(), input, len);
+		return XXH_OK == XXH32_update(st, input, static_cast<size_t>(len));
 	} else {
 		return false;
 	}
@@ -51,10 +56,15 @@ bool Xxh32::update(const void* input, int len) {
 uint32_t Xxh32::digest() {
 	Lock lock(mut);
 	if(st) {
-		return XXH32_intermediateDigest(st.get());
+		return XXH32_digest(st);
 	} else {
 		return 0;
 	}
 }
 
+
+uint32_t Xxh32::hash(const void* input, int len, uint32_t seed) {
+	return XXH32(input, static_cast<size_t>(len), seed);
+}
+
 } // namespace Lz4Mt
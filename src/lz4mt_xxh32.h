@@ -1,6 +1,8 @@
 #ifndef LZ4MT_XXH32_H
 #define LZ4MT_XXH32_H
 
+#include "xxhash.h"
+
 namespace Lz4Mt {
 
 class Xxh32 {
@@ -11,9 +13,15 @@ public:
 	bool update(const void* input, int len);
 	uint32_t digest();
 
+	// One-shot hash without a state.
+	static uint32_t hash(const void* input, int len, uint32_t seed);
+
 private:
+	Xxh32(const Xxh32&);
+	const Xxh32& operator=(const Xxh32&);
+
 	mutable std::mutex mut;
-	std::unique_ptr<char[]> st;
+	XXH32_state_t* st;
 };
 
 } // namespace Lz4Mt
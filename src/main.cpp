@@ -1,6 +1,9 @@
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <memory>
 #include <string>
 #include <string.h>
 #include <vector>
@@ -19,6 +22,7 @@
 #include "lz4hc.h"
 #include "lz4mt.h"
 #include "lz4mt_benchmark.h"
+#include "lz4mt_compat.h"
 #include "lz4mt_io_cstdio.h"
 
 // DISABLE_LZ4C_LEGACY_OPTIONS :
@@ -84,8 +88,29 @@ const char usage_advanced[] =
 #if !defined(DISABLE_LZ4MT_EXCLUSIVE_OPTIONS)
 	"\n"
 	"lz4mt exclusive arguments :\n"
+	" --fast[=#]       : Faster than -1, # : acceleration (default : 1)\n"
+	" --store          : Frame without compression (checksums as -BX/-Sx)\n"
 	" --lz4mt-thread=0 : Multi thread mode (default)\n"
 	" --lz4mt-thread=1 : Single thread mode\n"
+	" --lz4mt-thread=# : Multi thread mode with # worker threads\n"
+	" --lz4mt-cpu=LIST : Pin worker threads to LIST (e.g. 0-3,8-11)\n"
+	" --lz4mt-numa     : NUMA node local buffers and queues\n"
+	" --lz4mt-numa=0   : Disable NUMA placement (default)\n"
+	" --lz4mt-huge-pages   : Huge page buffers when available\n"
+	" --lz4mt-huge-pages=0 : Normal page buffers (default)\n"
+	" --lz4mt-memory=#[KMG] : Use at most # bytes of buffers (0 : unlimited)\n"
+	" --lz4mt-probe    : Store blocks which look incompressible without compressing\n"
+	" --lz4mt-probe=0  : Compress every block (default)\n"
+	" --lz4mt-min-savings=# : Store blocks which save less than # percent (default : 0)\n"
+	" --lz4mt-adaptive[=#] : Move each block's level between # (default : 1)\n"
+	"                    and the compression level, following the output speed\n"
+	" --lz4mt-hc-time=# : Compress a block fast when HC would take over # ms\n"
+	"                    (-B6 and -B7)\n"
+	" --lz4mt-dict=FILE : Use the last 64 KiB of FILE as preset dictionary\n"
+	" --lz4mt-dict-id=# : Write dictionary ID # to the header\n"
+	" --lz4mt-bench-levels=#,# : Benchmark every level in the range, --fast=# is -#\n"
+	" --train file(s)  : Write a raw dictionary to --lz4mt-dict=FILE (default : dictionary)\n"
+	"                    and print its dictID (from --lz4mt-dict-id=#, or computed)\n"
 #endif // DISABLE_LZ4MT_EXCLUSIVE_OPTIONS
 ;
 
@@ -230,11 +255,13 @@ public:
 		return compressionLevel;
 	}
 
-	void set(CompMode compMode, int compressionLevel = -1) {
+	void set(CompMode compMode) {
 		this->compMode = compMode;
-		if(compressionLevel >= 0) {
-			this->compressionLevel = compressionLevel;
-		}
+	}
+
+	void set(CompMode compMode, int compressionLevel) {
+		this->compMode = compMode;
+		this->compressionLevel = compressionLevel;
 	}
 
 private:
@@ -312,6 +339,17 @@ struct Option {
 		, compressionMode(CompMode::COMPRESS, 0)
 		, sd(lz4mtInitStreamDescriptor())
 		, mode(LZ4MT_MODE_DEFAULT)
+		, nThread(0)
+		, cpuList()
+		, numaPlacement(0)
+		, hugePages(0)
+		, memoryBudget(0)
+		, incompressibleProbe(0)
+		, minSavings(0)
+		, adaptiveLevel(0)
+		, minCompressionLevel(0)
+		, hcTimeLimit(0)
+		, dictFilename()
 		, inpFilename()
 		, outFilename()
 		, nullWrite(false)
@@ -375,7 +413,7 @@ struct Option {
 		options['8'] = [&]() { compressionMode.set(CompMode::COMPRESS, 8); };
 		options['9'] = [&]() { compressionMode.set(CompMode::COMPRESS, 9); };
 		options['A'] = [&]() { compressionMode.set(CompMode::COMPRESS, 'A' - '0'); };
-	//	options['l'] = [&]() { legacyFormat = true; };
+		options['l'] = [&]() { mode |= LZ4MT_MODE_LEGACY_FORMAT; };
 		options['d'] = [&]() { compressionMode.set(CompMode::DECOMPRESS); };
 		options['c'] = [&]() {
 			forceStdout = true;
@@ -444,17 +482,43 @@ struct Option {
 			return opts.find(getOptionName(s));
 		};
 
+		opts["--fast"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(a.empty()) {
+				compressionMode.set(CompMode::COMPRESS, -1);
+				return true;
+			} else if(isDigits(a) && a.size() < 9 && std::stoi(a) > 0) {
+				compressionMode.set(CompMode::COMPRESS, -std::stoi(a));
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --fast ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--store"] = [&](const std::string&) -> bool {
+			compressionMode.set(CompMode::COMPRESS);
+			mode |= LZ4MT_MODE_STORE;
+			return true;
+		};
+
 		opts["--lz4mt-thread"] = [&](const std::string& arg) -> bool {
 			auto a = getOptionArg(arg);
 			if(isDigits(a)) {
 				const auto v = std::stoi(a);
 				switch(v) {
-				default:
 				case 0:
 					mode &= ~LZ4MT_MODE_SEQUENTIAL;
+					nThread = 0;
 					break;
 				case 1:
 					mode |= LZ4MT_MODE_SEQUENTIAL;
+					nThread = 1;
+					break;
+				default:
+					mode &= ~LZ4MT_MODE_SEQUENTIAL;
+					nThread = v;
 					break;
 				}
 				return true;
@@ -464,6 +528,178 @@ struct Option {
 				return false;
 			}
 		};
+
+		opts["--lz4mt-cpu"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			std::vector<unsigned> cpus;
+			if(Lz4Mt::parseCpuList(a, cpus)) {
+				cpuList = a;
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-cpu ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-numa"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(a.empty() || "1" == a) {
+				numaPlacement = 1;
+				return true;
+			} else if("0" == a) {
+				numaPlacement = 0;
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-numa ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-huge-pages"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(a.empty() || "1" == a) {
+				hugePages = 1;
+				return true;
+			} else if("0" == a) {
+				hugePages = 0;
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-huge-pages ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-memory"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			const auto n = a.find_first_not_of("0123456789");
+			const std::string unit = std::string::npos == n ? "" : a.substr(n);
+			const int shift = unit.empty() ? 0
+							: "K" == unit ? 10
+							: "M" == unit ? 20
+							: "G" == unit ? 30
+							: -1;
+			if(a.empty() || 0 == n || shift < 0 || unit.size() > 1) {
+				output.display("lz4mt: Bad argument for --lz4mt-memory ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+			memoryBudget = std::stoull(a.substr(0, n)) << shift;
+			return true;
+		};
+
+		opts["--lz4mt-bench-levels"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			const auto isLevel = [&](const std::string& s) {
+				const auto d = s.substr(! s.empty() && '-' == s[0] ? 1 : 0);
+				return ! d.empty() && d.size() < 9 && isDigits(d);
+			};
+			const auto pos = a.find(',');
+			const auto first = a.substr(0, pos);
+			const auto last = std::string::npos == pos ? first : a.substr(pos+1);
+			if(isLevel(first) && isLevel(last) && std::stoi(first) <= std::stoi(last)) {
+				compressionMode.set(CompMode::COMPRESS);
+				benchmark.enable = true;
+				benchmark.levelSweep = true;
+				benchmark.firstLevel = std::stoi(first);
+				benchmark.lastLevel = std::stoi(last);
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-bench-levels ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-probe"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(a.empty() || "1" == a) {
+				incompressibleProbe = 1;
+				return true;
+			} else if("0" == a) {
+				incompressibleProbe = 0;
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-probe ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-min-savings"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(! a.empty() && a.size() <= 2 && isDigits(a)) {
+				minSavings = std::stoi(a);
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-min-savings ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-adaptive"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			const auto d = a.substr(! a.empty() && '-' == a[0] ? 1 : 0);
+			if(a.empty()) {
+				adaptiveLevel = 1;
+				minCompressionLevel = 1;
+				return true;
+			} else if(! d.empty() && d.size() < 9 && isDigits(d)) {
+				adaptiveLevel = 1;
+				minCompressionLevel = std::stoi(a);
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-adaptive ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-hc-time"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(! a.empty() && a.size() < 9 && isDigits(a)) {
+				hcTimeLimit = std::stoi(a);
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-hc-time ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-dict"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(! a.empty()) {
+				dictFilename = a;
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-dict ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--lz4mt-dict-id"] = [&](const std::string& arg) -> bool {
+			const auto a = getOptionArg(arg);
+			if(isDigits(a)) {
+				sd.flg.presetDictionary = 1;
+				sd.dictId = static_cast<uint32_t>(std::stoul(a));
+				return true;
+			} else {
+				output.display("lz4mt: Bad argument for --lz4mt-dict-id ["
+					 + std::string(a) + "]\n");
+				return false;
+			}
+		};
+
+		opts["--train"] = [&](const std::string&) -> bool {
+			compressionMode.set(CompMode::COMPRESS);
+			benchmark.training = true;
+			return true;
+		};
 #endif // DISABLE_LZ4MT_EXCLUSIVE_OPTIONS
 
 		while(!args.empty()) {
@@ -475,7 +711,7 @@ struct Option {
 			if(0 == a0) {
 				continue;
 			} else if('-' != a0) {
-				if(benchmark.enable) {
+				if(benchmark.enable || benchmark.training) {
 					benchmark.files.push_back(a);
 				} else if(inpFilename.empty()) {
 					// first provided filename is input
@@ -599,6 +835,16 @@ struct Option {
 
 		output.display(DisplayLevel::PROGRESSION, welcomeMessage);
 
+		// Training reads only the sample files.
+		if(benchmark.training) {
+			if(benchmark.files.empty()) {
+				showBadUsage();
+				throw Exception::BadUsage();
+			}
+			benchmark.dictFilename = dictFilename.empty() ? "dictionary" : dictFilename;
+			return;
+		}
+
 		//
 		// TODO : Investigate about 'blockSize'.
 		//	in lz4cli.c, blockSize is always 4096KiB.
@@ -732,6 +978,17 @@ struct Option {
 	CompressionMode compressionMode;
 	Lz4MtStreamDescriptor sd;
 	int mode;
+	int nThread;
+	std::string cpuList;
+	int numaPlacement;
+	int hugePages;
+	uint64_t memoryBudget;
+	int incompressibleProbe;
+	int minSavings;
+	int adaptiveLevel;
+	int minCompressionLevel;
+	int hcTimeLimit;
+	std::string dictFilename;
 	std::string inpFilename;
 	std::string outFilename;
 	bool nullWrite;
@@ -743,11 +1000,15 @@ struct Option {
 };
 
 
-typedef int (*CompressionFunc)
-	(const char* src, char* dst, int size, int maxOut, int maxOutputSize);
-
-int bridge_LZ4_compress_limitedOutput(const char* src, char* dst, int size, int maxOut, int) {
-	return LZ4_compress_limitedOutput(src, dst, size, maxOut);
+// Level >= 3 : HC, level < 0 : acceleration -level, otherwise acceleration 1.
+// Every level shares one state, so the level may change between calls.
+int compressLevel(void* state, const char* src, char* dst, int size, int maxOut, int compressionLevel) {
+	if(compressionLevel >= 3) {
+		return LZ4_compress_HC_extStateHC(state, src, dst, size, maxOut, compressionLevel);
+	} else {
+		const auto acceleration = compressionLevel < 0 ? -compressionLevel : 1;
+		return LZ4_compress_fast_extState(state, src, dst, size, maxOut, acceleration);
+	}
 }
 
 
@@ -766,6 +1027,18 @@ int lz4mtCommandLine(Output& output, int argc, char* argv[]) {
 
 	Lz4MtContext ctx = lz4mtInitContext();
 	ctx.mode				= static_cast<Lz4MtMode>(opt.mode);
+	ctx.nThread				= opt.nThread;
+	ctx.cpuList				= opt.cpuList.empty() ? nullptr : opt.cpuList.c_str();
+	ctx.numaPlacement		= opt.numaPlacement;
+	ctx.hugePages			= opt.hugePages;
+	ctx.memoryBudget		= opt.memoryBudget;
+	ctx.incompressibleProbe	= opt.incompressibleProbe;
+	ctx.minSavings			= opt.minSavings;
+	ctx.adaptiveLevel		= opt.adaptiveLevel;
+	ctx.minCompressionLevel	= opt.minCompressionLevel;
+	ctx.hcTimeLimit			= opt.hcTimeLimit;
+	Lz4MtStats stats		= lz4mtInitStats();
+	ctx.stats				= &stats;
 	ctx.read				= read;
 	ctx.readSeek			= readSeek;
 	ctx.readEof				= readEof;
@@ -773,16 +1046,35 @@ int lz4mtCommandLine(Output& output, int argc, char* argv[]) {
 	ctx.compressBound		= LZ4_compressBound;
 	ctx.decompress			= LZ4_decompress_safe;
 	ctx.compressionLevel	= opt.compressionMode.getCompressionLevel();
-	ctx.compress			= [&ctx]() -> CompressionFunc {
-		// NOTE for "-> CompressionFunc" :
-		//		It's a workaround for g++-4.6's strange warning.
+	ctx.compress			= compressLevel;
+	ctx.compressStateSize	= static_cast<size_t>(
+								std::max(LZ4_sizeofState(), LZ4_sizeofStateHC()));
 
-		if(ctx.compressionLevel >= 3) {
-			return LZ4_compressHC2_limitedOutput;
-		} else {
-			return bridge_LZ4_compress_limitedOutput;
+	if(opt.benchmark.training) {
+		opt.benchmark.openIstream	= openIstream;
+		opt.benchmark.closeIstream	= closeIstream;
+		opt.benchmark.getFilesize	= getFilesize;
+		const auto r = opt.benchmark.train(ctx, opt.sd);
+		if(0 != r) {
+			throw Exception::ExitError(r);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	std::unique_ptr<Lz4MtDictionary, void(*)(Lz4MtDictionary*)> dictionary(
+		nullptr, lz4mtDestroyDictionary);
+	if(! opt.dictFilename.empty()) {
+		std::ifstream ifs(opt.dictFilename, std::ios::binary);
+		if(! ifs) {
+			output.display(DisplayLevel::ERRORS
+						   , "Pb opening " + opt.dictFilename + "\n");
+			throw Exception::ExitError(12);
 		}
-	}();
+		const std::vector<char> d(
+			(std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+		dictionary.reset(lz4mtCreateDictionary(d.data(), d.size()));
+		ctx.dictionary = dictionary.get();
+	}
 
 	// Check if benchmark is selected
 	if(opt.benchmark.enable) {
@@ -833,6 +1125,20 @@ int lz4mtCommandLine(Output& output, int argc, char* argv[]) {
 		throw Exception::ExitError(13);
 	}
 
+	if(opt.compressionMode.isCompress()) {
+		// NOTE : The size of a regular input file lets small inputs be
+		//        estimated as such.  The header isn't affected.
+		auto sd = opt.sd;
+		if(const auto inputSize = getFilesize(opt.inpFilename)) {
+			sd.flg.streamSize = 1;
+			sd.streamSize = inputSize;
+		}
+		output.display(DisplayLevel::INFORMATION
+			, "Memory : "
+			+ std::to_string(lz4mtEstimateMemory(&ctx, &sd, 0) >> 10)
+			+ " KiB estimated peak\n");
+	}
+
 	const auto e = [&]() -> Lz4MtResult {
 		if(opt.compressionMode.isCompress()) {
 			return lz4mtCompress(&ctx, &opt.sd);
@@ -846,6 +1152,45 @@ int lz4mtCommandLine(Output& output, int argc, char* argv[]) {
 	closeOstream(&ctx);
 	closeIstream(&ctx);
 
+	if(stats.numaLocalBlocks || stats.numaRemoteBlocks) {
+		output.display(DisplayLevel::INFORMATION
+			, "NUMA placement : "
+			+ std::to_string(stats.numaLocalBlocks) + " local, "
+			+ std::to_string(stats.numaRemoteBlocks) + " remote blocks\n");
+	}
+	if(stats.probedRawBlocks) {
+		output.display(DisplayLevel::INFORMATION
+			, "Probe : " + std::to_string(stats.probedRawBlocks) + " blocks stored uncompressed\n");
+	}
+	if(stats.hcFallbackBlocks || stats.hcOverrunBlocks) {
+		output.display(DisplayLevel::INFORMATION
+			, "HC time limit : "
+			+ std::to_string(stats.hcFallbackBlocks) + " fallbacks, "
+			+ std::to_string(stats.hcOverrunBlocks) + " overruns\n");
+	}
+	if(opt.compressionMode.isCompress()) {
+		std::string levels;
+		for(int i = 0; i < LZ4MT_STATS_LEVEL_COUNT; ++i) {
+			if(const auto n = stats.levelBlocks[i]) {
+				levels += (levels.empty() ? "" : ", ")
+					+ std::to_string(LZ4MT_STATS_LEVEL_MIN + i) + " x " + std::to_string(n);
+			}
+		}
+		if(! levels.empty()) {
+			output.display(DisplayLevel::INFORMATION
+				, "Levels : " + levels + " blocks\n");
+		}
+	}
+	if(opt.compressionMode.isDecompress()) {
+		output.display(DisplayLevel::INFORMATION
+			, "History copies : " + std::to_string(stats.historyCopyBytes) + " bytes\n");
+	}
+	output.display(DisplayLevel::INFORMATION
+		, "Buffers : "
+		+ std::to_string(stats.bufferAllocs) + " allocs, "
+		+ std::to_string(stats.bufferFrees) + " frees, "
+		+ std::to_string(stats.bufferWaits) + " waits\n");
+
 	if(LZ4MT_RESULT_OK != e) {
 		output.display("lz4mt: " + std::string(lz4mtResultToString(e)) + "\n");
 		throw Exception::ExitError(static_cast<int>(e));